@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <cmath>
+#include "BallTree.h"
+#include "DistanceKernels.h"
+
+BallTree::BallTree(double threshold, DistanceMetric distanceMetric)
+        : metric(distanceMetric), split_threshold(threshold), leaf_size(1) {
+}
+
+void BallTree::clear() {
+    nodes.clear();
+    centers.clear();
+    features.clear();
+    label_ids.clear();
+    labels.clear();
+}
+
+void BallTree::setMetric(DistanceMetric distanceMetric) {
+    metric = distanceMetric;
+}
+
+DistanceMetric BallTree::getMetric() const {
+    return metric;
+}
+
+void BallTree::build(const Dataset& data) {
+    clear();
+    if (data.points.empty()) {
+        return;
+    }
+    features.assign(data.points[0].features.size(), data.points.size());
+    label_ids.resize(data.points.size());
+    for (size_t i = 0; i < data.points.size(); ++i) {
+        features.setRow(i, data.points[i].features);
+        label_ids[i] = labels.intern(data.points[i].label);
+    }
+    buildIndex();
+}
+
+void BallTree::build(const ColumnarDataset& data) {
+    clear();
+    if (data.size() == 0) {
+        return;
+    }
+    features.assign(data.features.dimensions(), data.size());
+    for (size_t d = 0; d < features.dimensions(); ++d) {
+        const double* column = data.features.column(d);
+        for (size_t i = 0; i < data.size(); ++i) {
+            features.set(i, d, column[i]);
+        }
+    }
+    if (data.label_ids.empty()) {
+        label_ids.assign(data.size(), labels.intern(""));
+    } else {
+        label_ids = data.label_ids;
+        labels = data.labels;
+    }
+    buildIndex();
+}
+
+void BallTree::build(const KD_Tree& tree) {
+    clear();
+    if (tree.getRoot() == nullptr) {
+        return;
+    }
+
+    // The rows the tree's leaves still reference, dead rows are skipped
+    std::vector<uint32_t> rows;
+    std::vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+        const KDTreeNode& node = tree.getNode(stack.back());
+        stack.pop_back();
+        if (!node.isLeaf()) {
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+            continue;
+        }
+        for (uint32_t row = node.begin(); row < node.end(); ++row) {
+            rows.push_back(row);
+        }
+    }
+
+    const FeatureMatrix& source = tree.getFeatures();
+    features.assign(source.dimensions(), rows.size());
+    label_ids.resize(rows.size());
+    for (size_t d = 0; d < features.dimensions(); ++d) {
+        const double* column = source.column(d);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            features.set(i, d, column[rows[i]]);
+        }
+    }
+    for (size_t i = 0; i < rows.size(); ++i) {
+        label_ids[i] = tree.getLabelId(rows[i]);
+    }
+    labels = tree.getLabels();
+    buildIndex();
+}
+
+void BallTree::buildIndex() {
+    size_t rowCount = features.size();
+    size_t dims = features.dimensions();
+
+    // Cosine search runs on unit vectors, zero vectors stay at the origin
+    if (metric == METRIC_COSINE) {
+        for (size_t i = 0; i < rowCount; ++i) {
+            double norm = 0.0;
+            for (size_t d = 0; d < dims; ++d) {
+                norm += features.at(i, d) * features.at(i, d);
+            }
+            norm = std::sqrt(norm);
+            for (size_t d = 0; d < dims && norm > 0.0; ++d) {
+                features.set(i, d, features.at(i, d) / norm);
+            }
+        }
+    }
+
+    leaf_size = KD_Tree::leafSizeFor(split_threshold, rowCount);
+    std::vector<uint32_t> order(rowCount);
+    for (uint32_t i = 0; i < rowCount; ++i) {
+        order[i] = i;
+    }
+    std::vector<double> projections(rowCount);
+    buildRecursive(order, projections, 0, static_cast<uint32_t>(rowCount));
+
+    // Store the rows in leaf order so every leaf scans a contiguous range
+    FeatureMatrix sorted;
+    sorted.assign(dims, rowCount);
+    std::vector<uint32_t> sortedLabels(rowCount);
+    for (size_t d = 0; d < dims; ++d) {
+        const double* column = features.column(d);
+        for (size_t i = 0; i < rowCount; ++i) {
+            sorted.set(i, d, column[order[i]]);
+        }
+    }
+    for (size_t i = 0; i < rowCount; ++i) {
+        sortedLabels[i] = label_ids[order[i]];
+    }
+    features = std::move(sorted);
+    label_ids.swap(sortedLabels);
+}
+
+uint32_t BallTree::buildRecursive(std::vector<uint32_t>& order, std::vector<double>& projections,
+                                  uint32_t begin, uint32_t end) {
+    size_t dims = features.dimensions();
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(BallTreeNode{0.0, begin, end, true});
+
+    // Center is the mean of the points, the radius reaches the farthest of them
+    std::vector<double> center(dims, 0.0);
+    for (size_t d = 0; d < dims; ++d) {
+        const double* column = features.column(d);
+        for (uint32_t i = begin; i < end; ++i) {
+            center[d] += column[order[i]];
+        }
+        center[d] /= end - begin;
+    }
+    centers.insert(centers.end(), center.begin(), center.end());
+
+    uint32_t farthest = order[begin];
+    for (uint32_t i = begin; i < end; ++i) {
+        double distance = rowDistance(center.data(), order[i]);
+        if (distance > nodes[index].radius) {
+            nodes[index].radius = distance;
+            farthest = order[i];
+        }
+    }
+
+    if (end - begin <= leaf_size) {
+        return index;
+    }
+
+    // Split at the median projection onto the line from the farthest point to the point farthest from it
+    std::vector<double> first = features.row(farthest);
+    uint32_t second = farthest;
+    double spread = 0.0;
+    for (uint32_t i = begin; i < end; ++i) {
+        double distance = rowDistance(first.data(), order[i]);
+        if (distance > spread) {
+            spread = distance;
+            second = order[i];
+        }
+    }
+    for (uint32_t i = begin; i < end; ++i) {
+        projections[order[i]] = 0.0;
+    }
+    for (size_t d = 0; d < dims; ++d) {
+        const double* column = features.column(d);
+        double direction = column[second] - first[d];
+        for (uint32_t i = begin; i < end; ++i) {
+            projections[order[i]] += column[order[i]] * direction;
+        }
+    }
+
+    uint32_t middle = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                     [&projections](uint32_t a, uint32_t b) { return projections[a] < projections[b]; });
+
+    uint32_t left = buildRecursive(order, projections, begin, middle);
+    uint32_t right = buildRecursive(order, projections, middle, end);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[index].leaf = false;
+    return index;
+}
+
+double BallTree::centerDistance(const double* point, uint32_t nodeIndex) const {
+    size_t dims = features.dimensions();
+    const double* center = centers.data() + static_cast<size_t>(nodeIndex) * dims;
+    double sum = 0.0;
+    if (metric == METRIC_MANHATTAN) {
+        for (size_t d = 0; d < dims; ++d) {
+            sum += std::fabs(point[d] - center[d]);
+        }
+        return sum;
+    }
+    for (size_t d = 0; d < dims; ++d) {
+        double diff = point[d] - center[d];
+        sum += diff * diff;
+    }
+    return std::sqrt(sum);
+}
+
+double BallTree::rowDistance(const double* point, uint32_t row) const {
+    double sum = 0.0;
+    if (metric == METRIC_MANHATTAN) {
+        for (size_t d = 0; d < features.dimensions(); ++d) {
+            sum += std::fabs(point[d] - features.at(row, d));
+        }
+        return sum;
+    }
+    for (size_t d = 0; d < features.dimensions(); ++d) {
+        double diff = point[d] - features.at(row, d);
+        sum += diff * diff;
+    }
+    return std::sqrt(sum);
+}
+
+void BallTree::leafKeys(const double* query, size_t begin, size_t end, double* out) const {
+    if (metric != METRIC_MANHATTAN) {
+        DistanceKernels::squaredDistances(features, begin, end, query, out);
+        return;
+    }
+
+    size_t count = end - begin;
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = 0.0;
+    }
+    for (size_t d = 0; d < features.dimensions(); ++d) {
+        const double* column = features.column(d) + begin;
+        for (size_t i = 0; i < count; ++i) {
+            out[i] += std::fabs(column[i] - query[d]);
+        }
+    }
+}
+
+const double* BallTree::prepareQuery(const double* query, std::vector<double>& buffer) const {
+    if (metric != METRIC_COSINE) {
+        return query;
+    }
+    size_t dims = features.dimensions();
+    double norm = 0.0;
+    for (size_t d = 0; d < dims; ++d) {
+        norm += query[d] * query[d];
+    }
+    norm = std::sqrt(norm);
+    buffer.resize(dims);
+    for (size_t d = 0; d < dims; ++d) {
+        buffer[d] = norm > 0.0 ? query[d] / norm : 0.0;
+    }
+    return buffer.data();
+}
+
+double BallTree::treeKey(double treeDistance) const {
+    return metric == METRIC_MANHATTAN ? treeDistance : treeDistance * treeDistance;
+}
+
+double BallTree::keyFromDistance(double distance) const {
+    switch (metric) {
+        case METRIC_MANHATTAN:
+            return distance;
+        case METRIC_COSINE:
+            return 2.0 * distance; // |a - b|^2 = 2 * (1 - cos) for unit vectors
+        default:
+            return distance * distance;
+    }
+}
+
+double BallTree::distanceFromKey(double key) const {
+    switch (metric) {
+        case METRIC_MANHATTAN:
+            return key;
+        case METRIC_COSINE:
+            return key / 2.0;
+        default:
+            return std::sqrt(key);
+    }
+}
+
+const FeatureMatrix& BallTree::getFeatures() const {
+    return features;
+}
+
+Point BallTree::getPoint(uint32_t index) const {
+    return Point(features.row(index), getLabel(index));
+}
+
+const std::string& BallTree::getLabel(uint32_t index) const {
+    return labels.name(label_ids[index]);
+}
+
+uint32_t BallTree::getLabelId(uint32_t index) const {
+    return label_ids[index];
+}
+
+const LabelTable& BallTree::getLabels() const {
+    return labels;
+}
+
+size_t BallTree::size() const {
+    return features.size();
+}
+
+void BallTree::kNN(KDTreeQuery& search) const {
+    search.capacity = search.k;
+    search.heap.clear();
+    search.heap.reserve(search.k);
+    search.nodes_visited = 0;
+    search.leaves_visited = 0;
+    search.distances_computed = 0;
+    if (search.distances.size() < leaf_size) {
+        search.distances.resize(leaf_size);
+    }
+
+    if (!nodes.empty() && search.k > 0) {
+        kNNRecursive(0, prepareQuery(search.query, search.query_buffer), search);
+    }
+
+    // Turn the max-heap into ascending key order
+    std::sort_heap(search.heap.begin(), search.heap.end());
+}
+
+void BallTree::kNNRecursive(uint32_t nodeIndex, const double* query, KDTreeQuery& search) const {
+    // Out of leaf budget, keep whatever has been found so far
+    if (search.options.max_leaves != 0 && search.leaves_visited >= search.options.max_leaves) {
+        return;
+    }
+
+    const BallTreeNode& node = nodes[nodeIndex];
+    ++search.nodes_visited;
+
+    if (node.leaf) {
+        ++search.leaves_visited;
+        size_t count = node.end() - node.begin();
+        leafKeys(query, node.begin(), node.end(), search.distances.data());
+        search.distances_computed += count;
+        for (size_t i = 0; i < count; ++i) {
+            search.offer(search.distances[i], node.begin() + static_cast<uint32_t>(i));
+        }
+        return;
+    }
+
+    // Closer center first; a child is only entered if its ball can still hold a better point,
+    // with epsilon > 0 only if it could beat the k-th best by a factor of (1+epsilon)
+    double leftDistance = centerDistance(query, node.left);
+    double rightDistance = centerDistance(query, node.right);
+    search.distances_computed += 2;
+
+    uint32_t children[2] = {node.left, node.right};
+    double distances[2] = {leftDistance, rightDistance};
+    if (rightDistance < leftDistance) {
+        std::swap(children[0], children[1]);
+        std::swap(distances[0], distances[1]);
+    }
+
+    double slack = 1.0 + search.options.epsilon;
+    for (int i = 0; i < 2; ++i) {
+        double bound = std::max(0.0, distances[i] - nodes[children[i]].radius);
+        if (search.heap.size() < search.capacity || treeKey(bound * slack) < search.heap.front().first) {
+            kNNRecursive(children[i], query, search);
+        }
+    }
+}
+
+template <typename Visitor>
+void BallTree::radiusRecursive(uint32_t nodeIndex, const double* query, double treeRadius, double keyRadius,
+                               std::vector<double>& keys, Visitor& visit) const {
+    const BallTreeNode& node = nodes[nodeIndex];
+    if (centerDistance(query, nodeIndex) - node.radius > treeRadius) {
+        return;
+    }
+
+    if (node.leaf) {
+        size_t count = node.end() - node.begin();
+        if (keys.size() < count) {
+            keys.resize(count);
+        }
+        leafKeys(query, node.begin(), node.end(), keys.data());
+        for (size_t i = 0; i < count; ++i) {
+            if (keys[i] <= keyRadius) {
+                visit(node.begin() + static_cast<uint32_t>(i), keys[i]);
+            }
+        }
+        return;
+    }
+
+    radiusRecursive(node.left, query, treeRadius, keyRadius, keys, visit);
+    radiusRecursive(node.right, query, treeRadius, keyRadius, keys, visit);
+}
+
+void BallTree::radiusSearch(const double* query, double radius, const RangeCallback& callback) const {
+    if (nodes.empty() || radius < 0) {
+        return;
+    }
+    std::vector<double> buffer;
+    std::vector<double> keys(leaf_size);
+    double keyRadius = keyFromDistance(radius);
+    double treeRadius = metric == METRIC_MANHATTAN ? keyRadius : std::sqrt(keyRadius);
+    radiusRecursive(0, prepareQuery(query, buffer), treeRadius, keyRadius, keys, callback);
+}
+
+size_t BallTree::radiusSearch(const double* query, double radius, std::vector<uint32_t>& rows) const {
+    size_t before = rows.size();
+    radiusSearch(query, radius, [&rows](uint32_t row, double) { rows.push_back(row); });
+    return rows.size() - before;
+}
+
+size_t BallTree::radiusCount(const double* query, double radius) const {
+    size_t count = 0;
+    radiusSearch(query, radius, [&count](uint32_t, double) { ++count; });
+    return count;
+}
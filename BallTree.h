@@ -0,0 +1,104 @@
+#ifndef BALL_TREE_H
+#define BALL_TREE_H
+
+#include "FeatureMatrix.h"
+#include "KD_Tree.h"
+#include "LabelTable.h"
+#include "kNN_Data.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Distance used by BallTree searches
+enum DistanceMetric {
+    METRIC_EUCLIDEAN,
+    METRIC_MANHATTAN,
+    METRIC_COSINE     // 1 - cosine similarity, searched as Euclidean distance between unit-length vectors
+};
+
+// Ball tree node, stored by value in BallTree::nodes and addressed by index
+struct BallTreeNode {
+    double radius;  // every point below the node is within radius (metric distance) of the center
+    uint32_t left;  // internal: left child index,  leaf: first row
+    uint32_t right; // internal: right child index, leaf: one past the last row
+    bool leaf;
+
+    uint32_t begin() const { return left; } // leaf range accessors
+    uint32_t end() const { return right; }
+};
+
+// Metric tree over a copy of the points: every node bounds its points with a ball, so
+// pruning only depends on distances and keeps working where KD_Tree's axis-aligned
+// splits stop pruning (roughly beyond 10 dimensions). Points are split by projecting
+// them onto the line between two far-apart points and cutting at the median.
+//
+// Search heaps and range callbacks carry ranking keys instead of plain distances:
+// squared Euclidean distance for METRIC_EUCLIDEAN and METRIC_COSINE (between unit
+// vectors, 2 * (1 - cos)), the L1 distance for METRIC_MANHATTAN. distanceFromKey
+// converts a key back to a distance of the metric.
+class BallTree {
+private:
+    std::vector<BallTreeNode> nodes; // preorder, nodes[0] is the root
+    std::vector<double> centers;     // row-major, the center of nodes[i] starts at i * dimensions
+    FeatureMatrix features;          // points in leaf order
+    std::vector<uint32_t> label_ids; // interned label of every row in features
+    LabelTable labels;
+    DistanceMetric metric;
+    double split_threshold; // leaf bucket size, as for KD_Tree::leafSizeFor
+    size_t leaf_size;
+
+    // Builds the tree over the rows loaded into features and label_ids
+    void buildIndex();
+    uint32_t buildRecursive(std::vector<uint32_t>& order, std::vector<double>& projections, uint32_t begin, uint32_t end);
+
+    // Metric distances from point to a node's center and to a row of features
+    double centerDistance(const double* point, uint32_t nodeIndex) const;
+    double rowDistance(const double* point, uint32_t row) const;
+    // Ranking keys of query against every row in [begin, end), written to out[0 .. end - begin)
+    void leafKeys(const double* query, size_t begin, size_t end, double* out) const;
+    // Query in the space the tree was built in (unit length for cosine), buffer is scratch space
+    const double* prepareQuery(const double* query, std::vector<double>& buffer) const;
+
+    // Key of a distance as measured inside the tree (Euclidean between unit vectors for cosine)
+    double treeKey(double treeDistance) const;
+
+    void kNNRecursive(uint32_t nodeIndex, const double* query, KDTreeQuery& search) const;
+    template <typename Visitor>
+    void radiusRecursive(uint32_t nodeIndex, const double* query, double treeRadius, double keyRadius,
+                         std::vector<double>& keys, Visitor& visit) const;
+
+public:
+    BallTree(double threshold = 0.1, DistanceMetric distanceMetric = METRIC_EUCLIDEAN);
+
+    void build(const Dataset& data);
+    void build(const ColumnarDataset& data);
+    void build(const KD_Tree& tree); // indexes the live points of tree, label ids stay the same
+    void clear();
+
+    void setMetric(DistanceMetric distanceMetric); // takes effect on the next build
+    DistanceMetric getMetric() const;
+
+    const FeatureMatrix& getFeatures() const;
+    Point getPoint(uint32_t index) const;
+    const std::string& getLabel(uint32_t index) const;
+    uint32_t getLabelId(uint32_t index) const;
+    const LabelTable& getLabels() const;
+    size_t size() const;
+
+    double distanceFromKey(double key) const;
+    double keyFromDistance(double distance) const;
+
+    // Read-only search with caller-owned state, safe to run from many threads at once.
+    // On return search.heap holds (key, row) pairs of the neighbors in ascending order.
+    void kNN(KDTreeQuery& search) const;
+
+    typedef KD_Tree::RangeCallback RangeCallback; // reports (row, key)
+
+    // Every point within radius (inclusive, in the metric's distance) of query
+    void radiusSearch(const double* query, double radius, const RangeCallback& callback) const;
+    size_t radiusSearch(const double* query, double radius, std::vector<uint32_t>& rows) const; // appends, returns the match count
+    size_t radiusCount(const double* query, double radius) const;
+};
+
+#endif // BALL_TREE_H
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include "BruteForce.h"
+#include "DistanceKernels.h"
+
+BruteForceSearch::BruteForceSearch() : rows(0) {
+}
+
+void BruteForceSearch::index(const KD_Tree& tree) {
+    clear();
+    if (tree.getRoot() == nullptr) {
+        return;
+    }
+
+    // Leaves in preorder, so the ranges come out in row order for a freshly built tree
+    std::vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+        const KDTreeNode& node = tree.getNode(stack.back());
+        stack.pop_back();
+        if (!node.isLeaf()) {
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+            continue;
+        }
+        if (node.begin() == node.end()) {
+            continue;
+        }
+        if (!ranges.empty() && ranges.back().second == node.begin()) {
+            ranges.back().second = node.end();
+        } else {
+            ranges.emplace_back(node.begin(), node.end());
+        }
+        rows += node.end() - node.begin();
+    }
+}
+
+void BruteForceSearch::clear() {
+    ranges.clear();
+    rows = 0;
+}
+
+void BruteForceSearch::kNN(const FeatureMatrix& features, KDTreeQuery* searches, size_t count) const {
+    size_t tileRows = std::max<size_t>(64, tile_bytes / sizeof(double) / std::max<size_t>(1, features.dimensions()));
+
+    for (size_t first = 0; first < count; first += query_block) {
+        size_t last = std::min(count, first + query_block);
+        for (size_t q = first; q < last; ++q) {
+            KDTreeQuery& search = searches[q];
+            search.capacity = search.k;
+            search.heap.clear();
+            search.heap.reserve(search.k);
+            search.nodes_visited = 0;
+            search.leaves_visited = 0;
+            search.distances_computed = 0;
+            if (search.distances.size() < tileRows) {
+                search.distances.resize(tileRows);
+            }
+        }
+
+        // One tile of training rows at a time, compared against every query of the block while it is in cache
+        for (const auto& range : ranges) {
+            for (size_t begin = range.first; begin < range.second; begin += tileRows) {
+                size_t end = std::min<size_t>(range.second, begin + tileRows);
+                for (size_t q = first; q < last; ++q) {
+                    KDTreeQuery& search = searches[q];
+                    if (search.k == 0) {
+                        continue;
+                    }
+                    ++search.nodes_visited;
+                    search.distances_computed += end - begin;
+                    DistanceKernels::squaredDistances(features, begin, end, search.query, search.distances.data());
+                    for (size_t i = 0; i < end - begin; ++i) {
+                        search.offer(search.distances[i], static_cast<uint32_t>(begin + i));
+                    }
+                }
+            }
+        }
+
+        for (size_t q = first; q < last; ++q) {
+            std::sort_heap(searches[q].heap.begin(), searches[q].heap.end());
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef BRUTE_FORCE_H
+#define BRUTE_FORCE_H
+
+#include "FeatureMatrix.h"
+#include "KD_Tree.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Exhaustive kNN over the live rows of a KD_Tree's feature matrix, ignoring the tree
+// structure. For small training sets or many dimensions this beats the tree: queries
+// are processed in blocks against cache-sized tiles of training rows, so every tile is
+// loaded once per block of queries instead of once per query.
+class BruteForceSearch {
+private:
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // live [begin, end) row runs, adjacent leaves merged
+    size_t rows;
+
+public:
+    static const size_t query_block = 8;       // queries sharing one pass over the training rows
+    static const size_t tile_bytes = 32 * 1024; // feature bytes per tile of training rows, about an L1 cache
+
+    BruteForceSearch();
+
+    // Collects the rows the tree's leaves reference, again after every insert/remove
+    void index(const KD_Tree& tree);
+    void clear();
+    size_t size() const { return rows; }
+
+    // Exact kNN for count searches at once, each with its own query and k. Results end up in
+    // every search's heap in ascending distance order, like KD_Tree::kNN
+    void kNN(const FeatureMatrix& features, KDTreeQuery* searches, size_t count) const;
+};
+
+#endif // BRUTE_FORCE_H
@@ -0,0 +1,617 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include "DiskKDTree.h"
+#include "DistanceKernels.h"
+#include "kNN_DAT_Parser.h"
+
+namespace {
+
+    // Points waiting to be placed in the tree, as records of dims doubles and a label id
+    struct Spill {
+        std::string path;
+        uint64_t rows;
+    };
+
+    // Buffered sequential record output
+    class SpillWriter {
+    public:
+        SpillWriter(const std::string& path, size_t dims, size_t bufferRecords)
+                : out(path, std::ios::binary | std::ios::trunc), dimensions(dims),
+                  record_bytes(dims * sizeof(double) + sizeof(uint32_t)), capacity(bufferRecords), rows(0) {
+            buffer.reserve(capacity * record_bytes);
+        }
+
+        void write(const double* values, uint32_t labelId) {
+            const char* bytes = reinterpret_cast<const char*>(values);
+            buffer.insert(buffer.end(), bytes, bytes + dimensions * sizeof(double));
+            bytes = reinterpret_cast<const char*>(&labelId);
+            buffer.insert(buffer.end(), bytes, bytes + sizeof(labelId));
+            ++rows;
+            if (buffer.size() >= capacity * record_bytes) {
+                flush();
+            }
+        }
+
+        // Writes out what is buffered, true if every record so far reached the file
+        bool finish() {
+            flush();
+            out.close();
+            return !out.fail();
+        }
+
+        uint64_t count() const { return rows; }
+
+    private:
+        void flush() {
+            out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+        }
+
+        std::ofstream out;
+        size_t dimensions;
+        size_t record_bytes;
+        size_t capacity;
+        uint64_t rows;
+        std::vector<char> buffer;
+    };
+
+    // Buffered sequential record input
+    class SpillReader {
+    public:
+        SpillReader(const std::string& path, size_t dims, size_t bufferRecords)
+                : in(path, std::ios::binary), dimensions(dims),
+                  record_bytes(dims * sizeof(double) + sizeof(uint32_t)), buffer(bufferRecords * record_bytes),
+                  filled(0), position(0) {}
+
+        // Copies the next record out, false at the end of the file
+        bool read(double* values, uint32_t& labelId) {
+            if (position == filled) {
+                in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                filled = static_cast<size_t>(in.gcount()) / record_bytes * record_bytes;
+                position = 0;
+                if (filled == 0) {
+                    return false;
+                }
+            }
+            std::memcpy(values, buffer.data() + position, dimensions * sizeof(double));
+            std::memcpy(&labelId, buffer.data() + position + dimensions * sizeof(double), sizeof(labelId));
+            position += record_bytes;
+            return true;
+        }
+
+    private:
+        std::ifstream in;
+        size_t dimensions;
+        size_t record_bytes;
+        std::vector<char> buffer;
+        size_t filled;
+        size_t position;
+    };
+
+    // Places spilled points into the index: leaf blocks are appended to out as the tree is
+    // built depth first, so they land in traversal order, and nodes collects the preorder node array
+    class ExternalBuilder {
+    public:
+        ExternalBuilder(std::ofstream& output, const std::string& spillPrefix, size_t dims, size_t leafSize,
+                        size_t ramBudget)
+                : out(output), prefix(spillPrefix), dimensions(dims), leaf_size(leafSize), spill_count(0),
+                  rows_written(0), labels_out(spillPrefix + ".labels", std::ios::binary | std::ios::trunc),
+                  failed(false) {
+            // A subset is built in memory once its input, the KD_Tree's copy and the build's
+            // per-row bookkeeping fit in the budget
+            size_t bytesPerRow = 2 * dims * sizeof(double) + 6 * sizeof(uint32_t);
+            rows_in_memory = std::max<size_t>(std::max<size_t>(leaf_size, 2), ramBudget / bytesPerRow);
+            buffer_records = std::max<size_t>(1, std::min<size_t>(1 << 12, rows_in_memory / 8));
+        }
+
+        std::vector<KDTreeNode> nodes;
+
+        std::string nextSpillPath() {
+            return prefix + ".spill" + std::to_string(spill_count++);
+        }
+
+        std::string labelPath() const { return prefix + ".labels"; }
+
+        // Builds the subtree over the points of spill and removes the spill file, false on I/O errors
+        bool build(const Spill& spill, size_t depth) {
+            bool ok = spill.rows <= rows_in_memory ? buildInMemory(spill) : split(spill, depth);
+            std::remove(spill.path.c_str());
+            return ok && !failed;
+        }
+
+        bool finish() {
+            labels_out.close();
+            return !labels_out.fail() && !failed;
+        }
+
+    private:
+        bool split(const Spill& spill, size_t depth) {
+            size_t dim = depth % dimensions;
+            std::vector<double> values(dimensions);
+            uint32_t labelId = 0;
+
+            // First pass: reservoir sample of the split coordinate, its median is the split value
+            std::vector<double> sample;
+            size_t sampleSize = std::min<size_t>(1 << 16, rows_in_memory);
+            std::mt19937_64 rng(spill.rows * 31 + depth);
+            double minimum = INFINITY;
+            {
+                SpillReader reader(spill.path, dimensions, buffer_records);
+                for (uint64_t seen = 0; reader.read(values.data(), labelId); ++seen) {
+                    minimum = std::min(minimum, values[dim]);
+                    if (sample.size() < sampleSize) {
+                        sample.push_back(values[dim]);
+                    } else {
+                        uint64_t slot = std::uniform_int_distribution<uint64_t>(0, seen)(rng);
+                        if (slot < sampleSize) {
+                            sample[slot] = values[dim];
+                        }
+                    }
+                }
+            }
+            if (sample.empty()) {
+                std::cerr << "Unable to read spill file: " << spill.path << std::endl;
+                return false;
+            }
+            std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+            double splitValue = sample[sample.size() / 2];
+
+            // Second pass: smaller values go left, larger right. Points equal to the split value may
+            // sit on either side of the plane, so they alternate to keep heavy ties balanced, starting
+            // on the side that would otherwise stay empty.
+            Spill left = {nextSpillPath(), 0};
+            Spill right = {nextSpillPath(), 0};
+            {
+                SpillReader reader(spill.path, dimensions, buffer_records);
+                SpillWriter leftWriter(left.path, dimensions, buffer_records);
+                SpillWriter rightWriter(right.path, dimensions, buffer_records);
+                bool tieGoesLeft = splitValue == minimum;
+                while (reader.read(values.data(), labelId)) {
+                    bool goesLeft = values[dim] < splitValue;
+                    if (values[dim] == splitValue) {
+                        goesLeft = tieGoesLeft;
+                        tieGoesLeft = !tieGoesLeft;
+                    }
+                    (goesLeft ? leftWriter : rightWriter).write(values.data(), labelId);
+                }
+                left.rows = leftWriter.count();
+                right.rows = rightWriter.count();
+                if (!leftWriter.finish() || !rightWriter.finish()) {
+                    std::cerr << "Unable to write spill files next to " << prefix << std::endl;
+                    std::remove(left.path.c_str());
+                    std::remove(right.path.c_str());
+                    return false;
+                }
+            }
+            std::remove(spill.path.c_str());
+
+            // Children are appended in preorder: the left subtree right behind its parent, then the right one
+            uint32_t nodeIndex = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(KDTreeNode::makeInternal(static_cast<int>(dim), splitValue));
+            nodes[nodeIndex].left = nodeIndex + 1;
+            if (!build(left, depth + 1)) {
+                std::remove(right.path.c_str());
+                return false;
+            }
+            nodes[nodeIndex].right = static_cast<uint32_t>(nodes.size());
+            return build(right, depth + 1);
+        }
+
+        bool buildInMemory(const Spill& spill) {
+            ColumnarDataset subset;
+            std::vector<uint32_t> labelIds(spill.rows);
+            std::vector<double> values(dimensions);
+            subset.features.assign(dimensions, spill.rows);
+            {
+                SpillReader reader(spill.path, dimensions, buffer_records);
+                for (size_t row = 0; row < spill.rows; ++row) {
+                    if (!reader.read(values.data(), labelIds[row])) {
+                        std::cerr << "Unable to read spill file: " << spill.path << std::endl;
+                        return false;
+                    }
+                    subset.features.setRow(row, values);
+                }
+            }
+
+            // Built unlabelled, sourceRows leads back to the label ids
+            KD_Tree tree(static_cast<double>(leaf_size));
+            std::vector<uint32_t> sourceRows;
+            tree.build(subset, sourceRows);
+
+            uint32_t nodeBase = static_cast<uint32_t>(nodes.size());
+            uint32_t rowBase = static_cast<uint32_t>(rows_written);
+            const FeatureMatrix& features = tree.getFeatures();
+            std::vector<uint32_t> leafLabels;
+            for (uint32_t i = 0; i < tree.getNodeCount(); ++i) {
+                KDTreeNode node = tree.getNode(i);
+                if (node.isLeaf()) {
+                    // KD_Tree's leaves follow its preorder, so its rows are already in traversal order
+                    for (size_t d = 0; d < dimensions; ++d) {
+                        out.write(reinterpret_cast<const char*>(features.column(d) + node.begin()),
+                                  static_cast<std::streamsize>((node.end() - node.begin()) * sizeof(double)));
+                    }
+                    leafLabels.clear();
+                    for (uint32_t row = node.begin(); row < node.end(); ++row) {
+                        leafLabels.push_back(labelIds[sourceRows[row]]);
+                    }
+                    labels_out.write(reinterpret_cast<const char*>(leafLabels.data()),
+                                     static_cast<std::streamsize>(leafLabels.size() * sizeof(uint32_t)));
+                    node.left += rowBase;
+                    node.right += rowBase;
+                } else {
+                    node.left += nodeBase;
+                    node.right += nodeBase;
+                }
+                nodes.push_back(node);
+            }
+            rows_written += features.size();
+            failed = failed || !out.good() || !labels_out.good();
+            return !failed;
+        }
+
+        std::ofstream& out;
+        std::string prefix;
+        size_t dimensions;
+        size_t leaf_size;
+        size_t rows_in_memory;
+        size_t buffer_records;
+        size_t spill_count;
+        uint64_t rows_written;
+        std::ofstream labels_out; // label ids in row order, copied into the index at the end
+        bool failed;
+    };
+
+    // Appends the contents of a file to out
+    bool copyFile(const std::string& path, std::ostream& out) {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<char> buffer(1 << 16);
+        while (in) {
+            in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            out.write(buffer.data(), in.gcount());
+        }
+        return in.eof() && out.good();
+    }
+}
+
+DiskKDTree::DiskKDTree() : DiskKDTree(1024.0) {
+}
+
+DiskKDTree::DiskKDTree(double threshold)
+        : leaf_data(nullptr), label_ids(nullptr), dims(0), rows(0), leaf_size(0), split_threshold(threshold),
+          ram_budget(size_t(256) << 20) {
+}
+
+DiskKDTree::~DiskKDTree() {
+    close();
+}
+
+void DiskKDTree::setRamBudget(size_t bytes) {
+    ram_budget = bytes;
+}
+
+bool DiskKDTree::build(const std::string& dataFile, const std::string& indexFile) {
+    close();
+
+    // Chunks of the reader count against the budget too, keep them a small part of it
+    kNN_Dat_ChunkReader reader(std::max<size_t>(1024, ram_budget / 1024));
+    if (!reader.open(dataFile)) {
+        return false;
+    }
+
+    // Pass over the parser output into the first spill file
+    std::string spillPrefix = indexFile + ".build";
+    Spill all = {spillPrefix + ".input", 0};
+    LabelTable fileLabels;
+    bool labelled = false;
+    {
+        SpillWriter writer(all.path, reader.dimensions(), 1 << 12);
+        ColumnarDataset chunk;
+        std::vector<double> values(reader.dimensions());
+        while (reader.next(chunk)) {
+            labelled = !chunk.label_ids.empty();
+            for (size_t row = 0; row < chunk.size(); ++row) {
+                for (size_t d = 0; d < values.size(); ++d) {
+                    values[d] = chunk.features.at(row, d);
+                }
+                writer.write(values.data(), labelled ? chunk.label_ids[row] : static_cast<uint32_t>(LabelTable::NOT_FOUND));
+            }
+            fileLabels = chunk.labels;
+        }
+        all.rows = writer.count();
+        if (!writer.finish()) {
+            std::cerr << "Unable to write spill file: " << all.path << std::endl;
+            std::remove(all.path.c_str());
+            return false;
+        }
+    }
+    if (all.rows == 0 || all.rows > UINT32_MAX) {
+        std::cerr << (all.rows == 0 ? "No points in " : "Too many points for one index in ") << dataFile << std::endl;
+        std::remove(all.path.c_str());
+        return false;
+    }
+
+    std::ofstream out(indexFile, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "Unable to open file: " << indexFile << std::endl;
+        std::remove(all.path.c_str());
+        return false;
+    }
+
+    DiskKDTreeHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, DISK_KD_TREE_MAGIC, sizeof(header.magic));
+    header.version = DISK_KD_TREE_VERSION;
+    header.endian_tag = MODEL_FILE_ENDIAN_TAG;
+    header.split_threshold = split_threshold;
+    header.dimensions = reader.dimensions();
+    header.rows = all.rows;
+    header.leaf_size = KD_Tree::leafSizeFor(split_threshold, all.rows);
+    header.label_count = fileLabels.size();
+
+    // Header goes in last, once every section offset is known; the leaves are streamed out as they are built
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ModelFileWriter::writeSection(out, nullptr, 0, header.leaves);
+    ExternalBuilder builder(out, spillPrefix, header.dimensions, header.leaf_size,
+                            std::max(ram_budget, header.leaf_size * header.dimensions * sizeof(double)));
+    bool built = builder.build(all, 0);
+    built = builder.finish() && built;
+    header.leaves.bytes = static_cast<uint64_t>(out.tellp()) - header.leaves.offset;
+
+    if (built && labelled) {
+        ModelFileWriter::writeSection(out, nullptr, 0, header.label_ids);
+        built = copyFile(builder.labelPath(), out);
+        header.label_ids.bytes = static_cast<uint64_t>(out.tellp()) - header.label_ids.offset;
+    }
+    std::remove(builder.labelPath().c_str());
+
+    header.node_count = builder.nodes.size();
+    ModelFileWriter::writeSection(out, builder.nodes.data(), builder.nodes.size() * sizeof(KDTreeNode), header.nodes);
+
+    std::string names;
+    for (const auto& name : fileLabels.getNames()) {
+        uint32_t length = static_cast<uint32_t>(name.size());
+        names.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        names.append(name);
+    }
+    ModelFileWriter::writeSection(out, names.data(), names.size(), header.label_names);
+    header.file_size = static_cast<uint64_t>(out.tellp());
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.close();
+
+    if (!built || !out) {
+        std::cerr << "Unable to write index file: " << indexFile << std::endl;
+        std::remove(indexFile.c_str());
+        return false;
+    }
+    return open(indexFile);
+}
+
+bool DiskKDTree::open(const std::string& indexFile) {
+    static_assert(sizeof(KDTreeNode) == 24, "KDTreeNode layout is part of the index file format");
+
+    close();
+    std::unique_ptr<MappedFile> mapped(new MappedFile());
+    if (!mapped->open(indexFile)) {
+        return false;
+    }
+
+    DiskKDTreeHeader header;
+    if (mapped->size() < sizeof(header)) {
+        std::cerr << "Not a disk kNN index: " << indexFile << std::endl;
+        return false;
+    }
+    std::memcpy(&header, mapped->data(), sizeof(header));
+
+    if (std::memcmp(header.magic, DISK_KD_TREE_MAGIC, sizeof(header.magic)) != 0) {
+        std::cerr << "Not a disk kNN index: " << indexFile << std::endl;
+        return false;
+    }
+    if (header.version != DISK_KD_TREE_VERSION || header.endian_tag != MODEL_FILE_ENDIAN_TAG) {
+        std::cerr << "Unsupported index file version or byte order: " << indexFile << std::endl;
+        return false;
+    }
+    if (header.file_size != mapped->size()) {
+        std::cerr << "Index file is truncated: " << indexFile << std::endl;
+        return false;
+    }
+    if (header.nodes.bytes != header.node_count * sizeof(KDTreeNode) ||
+        header.leaves.bytes != header.rows * header.dimensions * sizeof(double) ||
+        (header.label_ids.bytes != 0 && header.label_ids.bytes != header.rows * sizeof(uint32_t))) {
+        std::cerr << "Index file sections do not match the tree shape: " << indexFile << std::endl;
+        return false;
+    }
+
+    const KDTreeNode* nodeData = static_cast<const KDTreeNode*>(mapped->section(header.nodes, alignof(KDTreeNode)));
+    const double* leafData = static_cast<const double*>(mapped->section(header.leaves, alignof(double)));
+    const uint32_t* labelData = static_cast<const uint32_t*>(mapped->section(header.label_ids, alignof(uint32_t)));
+    const char* nameData = static_cast<const char*>(mapped->section(header.label_names, 1));
+    if (!nodeData || !leafData || !labelData || !nameData) {
+        std::cerr << "Index file sections are out of bounds or misaligned: " << indexFile << std::endl;
+        return false;
+    }
+
+    const char* cursor = nameData;
+    const char* namesEnd = nameData + header.label_names.bytes;
+    for (uint64_t i = 0; i < header.label_count; ++i) {
+        uint32_t length = 0;
+        if (namesEnd - cursor < static_cast<std::ptrdiff_t>(sizeof(length))) {
+            std::cerr << "Index file label table is truncated: " << indexFile << std::endl;
+            labels.clear();
+            return false;
+        }
+        std::memcpy(&length, cursor, sizeof(length));
+        cursor += sizeof(length);
+        if (static_cast<uint64_t>(namesEnd - cursor) < length) {
+            std::cerr << "Index file label table is truncated: " << indexFile << std::endl;
+            labels.clear();
+            return false;
+        }
+        labels.intern(std::string(cursor, length));
+        cursor += length;
+    }
+
+    // The node array is the resident top of the tree, copied so searches never fault on it;
+    // preorder lists the leaves in file order
+    nodes.assign(nodeData, nodeData + header.node_count);
+    for (const auto& node : nodes) {
+        if (node.isLeaf()) {
+            leaf_begins.push_back(node.begin());
+        }
+    }
+    leaf_begins.push_back(static_cast<uint32_t>(header.rows));
+
+    // Leaves are read wherever the queries lead, readahead would mostly fetch pages nobody asked for
+    mapped->adviseRandomAccess();
+    file = std::move(mapped);
+    leaf_data = leafData;
+    label_ids = header.label_ids.bytes != 0 ? labelData : nullptr;
+    dims = header.dimensions;
+    rows = header.rows;
+    leaf_size = header.leaf_size;
+    split_threshold = header.split_threshold;
+    return true;
+}
+
+void DiskKDTree::close() {
+    nodes.clear();
+    leaf_begins.clear();
+    file.reset();
+    leaf_data = nullptr;
+    label_ids = nullptr;
+    labels.clear();
+    dims = 0;
+    rows = 0;
+    leaf_size = 0;
+}
+
+bool DiskKDTree::isOpen() const {
+    return file != nullptr;
+}
+
+size_t DiskKDTree::size() const {
+    return rows;
+}
+
+size_t DiskKDTree::dimensions() const {
+    return dims;
+}
+
+size_t DiskKDTree::getNodeCount() const {
+    return nodes.size();
+}
+
+size_t DiskKDTree::getLeafSize() const {
+    return leaf_size;
+}
+
+Point DiskKDTree::getPoint(uint32_t row) const {
+    // The leaf holding row decides the column stride of its block
+    size_t leaf = std::upper_bound(leaf_begins.begin(), leaf_begins.end(), row) - leaf_begins.begin() - 1;
+    uint32_t begin = leaf_begins[leaf];
+    size_t count = leaf_begins[leaf + 1] - begin;
+    const double* block = leaf_data + static_cast<size_t>(begin) * dims;
+
+    std::vector<double> values(dims);
+    for (size_t d = 0; d < dims; ++d) {
+        values[d] = block[d * count + (row - begin)];
+    }
+    return Point(values, getLabel(row));
+}
+
+uint32_t DiskKDTree::getLabelId(uint32_t row) const {
+    return label_ids != nullptr ? label_ids[row] : LabelTable::NOT_FOUND;
+}
+
+const std::string& DiskKDTree::getLabel(uint32_t row) const {
+    static const std::string unlabelled;
+    return label_ids != nullptr ? labels.name(label_ids[row]) : unlabelled;
+}
+
+const LabelTable& DiskKDTree::getLabels() const {
+    return labels;
+}
+
+size_t DiskKDTree::kNN(const double* query, size_t k, KDTreeNeighbor* out, KDTreeQuery& context) const {
+    context.query = query;
+    context.k = k;
+    kNN(context);
+    for (size_t i = 0; i < context.heap.size(); ++i) {
+        out[i].index = context.heap[i].second;
+        out[i].distance = std::sqrt(context.heap[i].first);
+    }
+    return context.heap.size();
+}
+
+size_t DiskKDTree::kNN(const double* query, size_t k, KDTreeNeighbor* out, const KDTreeSearchOptions& options) const {
+    static thread_local KDTreeQuery context(nullptr, 0);
+    context.options = options;
+    return kNN(query, k, out, context);
+}
+
+void DiskKDTree::kNN(KDTreeQuery& search) const {
+    search.capacity = search.k;
+    search.heap.clear();
+    search.heap.reserve(search.capacity);
+    search.nodes_visited = 0;
+    search.leaves_visited = 0;
+    search.distances_computed = 0;
+    if (search.distances.size() < leaf_size) {
+        search.distances.resize(leaf_size);
+    }
+
+    if (!nodes.empty() && search.k > 0) {
+        kNNRecursive(0, search);
+    }
+    std::sort_heap(search.heap.begin(), search.heap.end());
+}
+
+void DiskKDTree::scanLeaf(const KDTreeNode& leaf, KDTreeQuery& search) const {
+    size_t count = leaf.end() - leaf.begin();
+    if (search.distances.size() < count) {
+        search.distances.resize(count);
+    }
+
+    // The leaf's block is a small column-major matrix of its own, viewed in place in the mapping
+    FeatureMatrix block;
+    block.attach(leaf_data + static_cast<size_t>(leaf.begin()) * dims, dims, count, count);
+    DistanceKernels::squaredDistances(block, 0, count, search.query, search.distances.data());
+    search.distances_computed += count;
+
+    for (size_t i = 0; i < count; ++i) {
+        search.offer(search.distances[i], leaf.begin() + static_cast<uint32_t>(i));
+    }
+}
+
+void DiskKDTree::kNNRecursive(uint32_t nodeIndex, KDTreeQuery& search) const {
+    // Same descent and pruning as KD_Tree::kNNRecursive, only the leaf scans touch the file
+    if (search.options.max_leaves != 0 && search.leaves_visited >= search.options.max_leaves) {
+        return;
+    }
+
+    const KDTreeNode& node = nodes[nodeIndex];
+    ++search.nodes_visited;
+
+    if (node.isLeaf()) {
+        ++search.leaves_visited;
+        scanLeaf(node, search);
+        return;
+    }
+
+    double diff = search.query[node.split_dimension] - node.split_value;
+    double distToPlane = diff * diff;
+    uint32_t nearChild = diff < 0 ? node.left : node.right;
+    uint32_t farChild = diff < 0 ? node.right : node.left;
+
+    kNNRecursive(nearChild, search);
+
+    double slack = 1.0 + search.options.epsilon;
+    if (search.heap.size() < search.capacity || distToPlane * slack * slack < search.heap.front().first) {
+        kNNRecursive(farChild, search);
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef DISK_KD_TREE_H
+#define DISK_KD_TREE_H
+
+#include "KD_Tree.h"
+#include "KDT_Node.h"
+#include "LabelTable.h"
+#include "ModelFile.h"
+#include "kNN_Data.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// On-disk layout of a DiskKDTree index, sections as in ModelFile.h.
+// Leaves are stored in traversal order (the order a depth-first search meets them), so a
+// leaf with rows [begin, end) is one block of dimensions columns of end - begin doubles
+// starting at double begin * dimensions of the leaves section, and neighboring leaves of
+// the tree are neighbors in the file.
+const char DISK_KD_TREE_MAGIC[8] = {'K', 'N', 'N', 'D', 'I', 'S', 'K', 'T'};
+const uint32_t DISK_KD_TREE_VERSION = 1;
+
+struct DiskKDTreeHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_tag;    // MODEL_FILE_ENDIAN_TAG
+    uint64_t file_size;
+
+    double split_threshold;
+    uint64_t dimensions;
+    uint64_t rows;
+    uint64_t node_count;
+    uint64_t leaf_size;
+    uint64_t label_count;
+
+    ModelSection nodes;       // KDTreeNode[node_count] in preorder, leaf ranges are rows of the leaves section
+    ModelSection leaves;      // rows * dimensions doubles, one column-major block per leaf
+    ModelSection label_ids;   // uint32_t[rows], empty for unlabelled data
+    ModelSection label_names; // label_count entries of (uint32_t length, chars)
+};
+
+// Out-of-core KD-tree for training sets larger than RAM. Only the node array stays resident;
+// the points live in leaf buckets of a memory-mapped index file, and a query pages in just
+// the leaves it scans. The leaf size decides the trade-off: resident memory is about
+// 50 bytes per leaf, so disk indexes want buckets of hundreds or thousands of points.
+//
+// build() never holds the whole dataset: the .dat file is streamed through
+// kNN_Dat_ChunkReader into a spill file, and subsets larger than the RAM budget are split
+// at a sampled median into two new spill files until each fits, at which point it is built
+// in memory as an ordinary KD_Tree and appended to the index.
+//
+// Points are indexed as they are in the file, without KNN's standardization.
+class DiskKDTree {
+private:
+    std::vector<KDTreeNode> nodes;     // resident copy of the file's node array
+    std::vector<uint32_t> leaf_begins; // first row of every leaf in file order, then the row count
+    std::unique_ptr<MappedFile> file;
+    const double* leaf_data;           // leaves section of the mapped file
+    const uint32_t* label_ids;         // nullptr for unlabelled data
+    LabelTable labels;
+    size_t dims;
+    size_t rows;
+    size_t leaf_size;
+    double split_threshold;
+    size_t ram_budget; // bytes of points build() may hold in memory at once
+
+    void kNNRecursive(uint32_t nodeIndex, KDTreeQuery& search) const;
+    void scanLeaf(const KDTreeNode& leaf, KDTreeQuery& search) const;
+
+public:
+    DiskKDTree();                 // split_threshold 1024 points per leaf, 256 MiB build budget
+    DiskKDTree(double threshold); // same meaning as KD_Tree's split_threshold
+    ~DiskKDTree();
+
+    // Takes effect on the next build(), budgets below a single leaf are raised to one leaf
+    void setRamBudget(size_t bytes);
+
+    // Writes an index of dataFile to indexFile and opens it. Spill files are created next to
+    // indexFile and removed again, they take up to about twice the size of the data.
+    bool build(const std::string& dataFile, const std::string& indexFile);
+
+    bool open(const std::string& indexFile);
+    void close();
+    bool isOpen() const;
+
+    size_t size() const;
+    size_t dimensions() const;
+    size_t getNodeCount() const;
+    size_t getLeafSize() const;
+
+    // Row accessors read through the mapping, rows are numbered in file order
+    Point getPoint(uint32_t row) const;
+    uint32_t getLabelId(uint32_t row) const; // LabelTable::NOT_FOUND for unlabelled data
+    const std::string& getLabel(uint32_t row) const;
+    const LabelTable& getLabels() const;
+
+    // Same contracts as the KD_Tree searches: on return search.heap holds the neighbors in
+    // ascending distance order, and leaves_visited counts the leaf blocks read
+    void kNN(KDTreeQuery& search) const;
+    size_t kNN(const double* query, size_t k, KDTreeNeighbor* out, KDTreeQuery& context) const;
+    size_t kNN(const double* query, size_t k, KDTreeNeighbor* out,
+               const KDTreeSearchOptions& options = KDTreeSearchOptions()) const;
+};
+
+#endif // DISK_KD_TREE_H
@@ -0,0 +1,75 @@
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+#include "FeatureMatrix.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Vectorized distance evaluation over FeatureMatrix rows. The implementation
+// (scalar, SSE2 or AVX2) is picked once at runtime from the CPU's features, and
+// per call from the dimension count: common counts have instantiations with the
+// dimension loop unrolled at compile time.
+class DistanceKernels {
+public:
+    enum ISA {
+        SCALAR,
+        SSE2,
+        AVX2
+    };
+
+    // Writes the squared Euclidean distance between query and every row in
+    // [begin, end) of matrix into out[0 .. end - begin)
+    static void squaredDistances(const FeatureMatrix& matrix, size_t begin, size_t end,
+                                 const double* query, double* out);
+
+    // Same for the rows listed in rows[0 .. count), which need not be contiguous (candidate re-ranking)
+    static void squaredDistancesAt(const FeatureMatrix& matrix, const uint32_t* rows, size_t count,
+                                   const double* query, double* out);
+
+    static ISA activeISA();
+
+    // True if dims has a compile-time specialized kernel (2, 3, 4, 7 and 8)
+    static bool isSpecialized(size_t dims);
+
+    // Forces a specific implementation (for benchmarking), returns false if the CPU cannot run it
+    static bool selectISA(ISA isa);
+
+    static const char* isaName(ISA isa);
+
+private:
+    // base points at the first row of column 0, column d starts at base + d * stride
+    typedef void (*Kernel)(const double* base, size_t stride, size_t dims, size_t count,
+                           const double* query, double* out);
+
+    // D > 0 fixes the dimension count at compile time (dims is ignored), D == 0 reads dims
+    template <size_t D>
+    static void scalarKernel(const double* base, size_t stride, size_t dims, size_t count,
+                             const double* query, double* out);
+    template <size_t D>
+    static void sse2Kernel(const double* base, size_t stride, size_t dims, size_t count,
+                           const double* query, double* out);
+    template <size_t D>
+    static void avx2Kernel(const double* base, size_t stride, size_t dims, size_t count,
+                           const double* query, double* out);
+
+    typedef void (*GatherKernel)(const double* base, size_t stride, size_t dims, const uint32_t* rows,
+                                 size_t count, const double* query, double* out);
+
+    // Scattered rows defeat vector loads, so the gather kernel is scalar and only specialized on D
+    template <size_t D>
+    static void gatherKernel(const double* base, size_t stride, size_t dims, const uint32_t* rows, size_t count,
+                             const double* query, double* out);
+    static GatherKernel gatherKernelFor(size_t dims);
+
+    static bool cpuSupports(ISA isa);
+    static ISA detectISA();
+    template <size_t D>
+    static Kernel kernelFor(ISA isa);
+    static Kernel kernelFor(ISA isa, size_t dims);
+
+    // Selected ISA, initialised on first use so other static initialisers can call in safely
+    static ISA& active();
+};
+
+#endif // DISTANCE_KERNELS_H
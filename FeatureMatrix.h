@@ -0,0 +1,108 @@
+#ifndef FEATURE_MATRIX_H
+#define FEATURE_MATRIX_H
+
+#include "MappedArray.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Structure-of-arrays feature storage: one contiguous column per feature, so a
+// leaf's [begin, end) range is a run of consecutive doubles in every column.
+// The columns can also be attached read-only from a memory-mapped model file.
+class FeatureMatrix {
+private:
+    MappedArray<double> storage; // column-major, column d starts at d * stride
+    size_t dims;
+    size_t rows;
+    size_t stride; // allocated rows per column, >= rows
+
+public:
+    FeatureMatrix() : dims(0), rows(0), stride(0) {}
+
+    // Resets the matrix to rowCount zeroed rows of dimensionCount features
+    void assign(size_t dimensionCount, size_t rowCount) {
+        dims = dimensionCount;
+        rows = rowCount;
+        stride = rowCount;
+        storage.assign(dims * stride, 0.0);
+    }
+
+    void clear() {
+        storage.clear();
+        dims = rows = stride = 0;
+    }
+
+    // Reads the columns from external memory laid out as dimensionCount columns of columnStride doubles
+    void attach(const double* data, size_t dimensionCount, size_t rowCount, size_t columnStride) {
+        storage.attach(data, dimensionCount * columnStride);
+        dims = dimensionCount;
+        rows = rowCount;
+        stride = columnStride;
+    }
+
+    // Copies attached columns into owned memory, required before any of the mutating members
+    void detach() { storage.detach(); }
+    bool isAttached() const { return storage.isAttached(); }
+
+    size_t dimensions() const { return dims; }
+    size_t size() const { return rows; }
+    bool empty() const { return rows == 0; }
+    size_t columnStride() const { return stride; }
+
+    const double* column(size_t d) const { return storage.data() + d * stride; }
+    // Writable column d, only valid on owned storage (see detach) with at least one allocated row
+    double* mutableColumn(size_t d) { return &storage[d * stride]; }
+
+    double at(size_t row, size_t d) const { return storage.data()[d * stride + row]; }
+
+    void set(size_t row, size_t d, double value) {
+        storage[d * stride + row] = value;
+    }
+
+    void setRow(size_t row, const std::vector<double>& values) {
+        for (size_t d = 0; d < dims; ++d) {
+            storage[d * stride + row] = values[d];
+        }
+    }
+
+    void copyRow(size_t destination, size_t source) {
+        for (size_t d = 0; d < dims; ++d) {
+            storage[d * stride + destination] = storage[d * stride + source];
+        }
+    }
+
+    // Adds count zeroed rows at the end and returns the index of the first one.
+    // Columns grow geometrically, so appending one row at a time is amortized O(dims).
+    size_t appendRows(size_t count) {
+        size_t first = rows;
+        if (rows + count > stride) {
+            size_t newStride = std::max(rows + count, stride * 2);
+            std::vector<double> grown(dims * newStride, 0.0);
+            for (size_t d = 0; d < dims; ++d) {
+                std::copy(column(d), column(d) + rows, grown.begin() + d * newStride);
+            }
+            storage.adopt(grown);
+            stride = newStride;
+        } else {
+            storage.detach();
+        }
+        rows += count;
+        return first;
+    }
+
+    // Drops the rows from rowCount on, the columns keep their allocation
+    void truncate(size_t rowCount) {
+        rows = std::min(rows, rowCount);
+    }
+
+    std::vector<double> row(size_t row) const {
+        std::vector<double> values(dims);
+        for (size_t d = 0; d < dims; ++d) {
+            values[d] = at(row, d);
+        }
+        return values;
+    }
+};
+
+#endif // FEATURE_MATRIX_H
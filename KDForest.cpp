@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include "KDForest.h"
+
+namespace {
+
+    // Per-thread search states of the shards, they only grow
+    std::vector<KDTreeQuery>& shardSearches(size_t count) {
+        static thread_local std::vector<KDTreeQuery> searches;
+        if (searches.size() < count) {
+            searches.resize(count, KDTreeQuery(nullptr, 0));
+        }
+        return searches;
+    }
+}
+
+KDForest::KDForest(double threshold, size_t shardCount) : split_threshold(threshold), shard_count(shardCount) {
+}
+
+void KDForest::setShardCount(size_t shardCount) {
+    shard_count = shardCount;
+}
+
+size_t KDForest::getShardCount() const {
+    return shards.size();
+}
+
+void KDForest::clear() {
+    shards.clear();
+    row_offsets.clear();
+    label_ids.clear();
+    labels.clear();
+}
+
+template <typename Fill>
+void KDForest::buildShards(size_t rowCount, size_t dims, const Fill& fill, const std::vector<uint32_t>& sourceLabels) {
+    size_t count = shard_count > 0 ? shard_count : std::max(1u, std::thread::hardware_concurrency());
+    count = std::max<size_t>(1, std::min(count, rowCount));
+    if (!pool || pool->size() != count) {
+        pool.reset(new ThreadPool(count));
+    }
+
+    // Round robin: shard s gets source rows s, s + count, s + 2 * count, ...
+    row_offsets.assign(count + 1, 0);
+    for (size_t s = 0; s < count; ++s) {
+        row_offsets[s + 1] = row_offsets[s] + static_cast<uint32_t>((rowCount - s + count - 1) / count);
+    }
+    label_ids.assign(rowCount, static_cast<uint32_t>(LabelTable::NOT_FOUND));
+
+    // Every shard gets the bucket size one tree over all rows would have
+    double shardThreshold = static_cast<double>(KD_Tree::leafSizeFor(split_threshold, rowCount));
+    shards.assign(count, KD_Tree(shardThreshold));
+
+    pool->parallelFor(count, 1, [&](size_t begin, size_t end, size_t) {
+        std::vector<double> values(dims);
+        for (size_t s = begin; s < end; ++s) {
+            size_t shardRows = row_offsets[s + 1] - row_offsets[s];
+            ColumnarDataset part;
+            part.features.assign(dims, shardRows);
+            for (size_t i = 0; i < shardRows; ++i) {
+                fill(s + i * count, values.data());
+                for (size_t d = 0; d < dims; ++d) {
+                    part.features.set(i, d, values[d]);
+                }
+            }
+
+            // The shards already keep every worker busy, so each builds on its own thread
+            std::vector<uint32_t> sourceRows;
+            shards[s].setParallelBuildCutoff(std::numeric_limits<size_t>::max());
+            shards[s].build(part, sourceRows);
+            if (!sourceLabels.empty()) {
+                for (size_t row = 0; row < shardRows; ++row) {
+                    label_ids[row_offsets[s] + row] = sourceLabels[s + sourceRows[row] * count];
+                }
+            }
+        }
+    });
+}
+
+void KDForest::build(const ColumnarDataset& data) {
+    clear();
+    if (data.size() == 0) {
+        return;
+    }
+
+    const FeatureMatrix& features = data.features;
+    buildShards(data.size(), features.dimensions(), [&features](size_t row, double* values) {
+        for (size_t d = 0; d < features.dimensions(); ++d) {
+            values[d] = features.at(row, d);
+        }
+    }, data.label_ids);
+    labels = data.labels;
+}
+
+void KDForest::build(const KD_Tree& tree) {
+    clear();
+    if (tree.getRoot() == nullptr) {
+        return;
+    }
+
+    // The rows the tree's leaves still reference, dead rows are skipped
+    std::vector<uint32_t> rows;
+    std::vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+        const KDTreeNode& node = tree.getNode(stack.back());
+        stack.pop_back();
+        if (!node.isLeaf()) {
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+            continue;
+        }
+        for (uint32_t row = node.begin(); row < node.end(); ++row) {
+            rows.push_back(row);
+        }
+    }
+    if (rows.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> sourceLabels(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        sourceLabels[i] = tree.getLabelId(rows[i]);
+    }
+    const FeatureMatrix& features = tree.getFeatures();
+    buildShards(rows.size(), features.dimensions(), [&features, &rows](size_t row, double* values) {
+        for (size_t d = 0; d < features.dimensions(); ++d) {
+            values[d] = features.at(rows[row], d);
+        }
+    }, sourceLabels);
+    labels = tree.getLabels();
+}
+
+const KD_Tree& KDForest::getShard(size_t shard) const {
+    return shards[shard];
+}
+
+uint32_t KDForest::getRowOffset(size_t shard) const {
+    return row_offsets[shard];
+}
+
+Point KDForest::getPoint(uint32_t row) const {
+    size_t shard = std::upper_bound(row_offsets.begin(), row_offsets.end(), row) - row_offsets.begin() - 1;
+    Point point = shards[shard].getPoint(row - row_offsets[shard]);
+    point.label = getLabel(row);
+    return point;
+}
+
+const std::string& KDForest::getLabel(uint32_t row) const {
+    static const std::string unlabelled;
+    return label_ids[row] != LabelTable::NOT_FOUND ? labels.name(label_ids[row]) : unlabelled;
+}
+
+uint32_t KDForest::getLabelId(uint32_t row) const {
+    return label_ids[row];
+}
+
+const LabelTable& KDForest::getLabels() const {
+    return labels;
+}
+
+size_t KDForest::size() const {
+    return label_ids.size();
+}
+
+void KDForest::kNN(KDTreeQuery& search, bool concurrent) const {
+    search.capacity = search.k;
+    search.heap.clear();
+    search.nodes_visited = 0;
+    search.leaves_visited = 0;
+    search.distances_computed = 0;
+    KNN_STATS(search.backtracks = 0; search.pruned = 0;)
+    if (shards.empty() || search.k == 0) {
+        return;
+    }
+
+    std::atomic<double> bound(INFINITY);
+    std::vector<KDTreeQuery>& searches = shardSearches(shards.size());
+    for (size_t s = 0; s < shards.size(); ++s) {
+        searches[s].query = search.query;
+        searches[s].k = search.k;
+        searches[s].options = search.options;
+        searches[s].shared_bound = &bound;
+    }
+
+    auto searchShards = [&](size_t begin, size_t end, size_t) {
+        for (size_t s = begin; s < end; ++s) {
+            shards[s].kNN(searches[s]);
+        }
+    };
+    if (!concurrent || !pool->tryParallelFor(shards.size(), 1, searchShards)) {
+        searchShards(0, shards.size(), 0);
+    }
+
+    // Merge the shards' lists, each is sorted and at most k long
+    for (size_t s = 0; s < shards.size(); ++s) {
+        const KDTreeQuery& part = searches[s];
+        for (const auto& neighbor : part.heap) {
+            search.heap.emplace_back(neighbor.first, row_offsets[s] + neighbor.second);
+        }
+        search.nodes_visited += part.nodes_visited;
+        search.leaves_visited += part.leaves_visited;
+        search.distances_computed += part.distances_computed;
+        KNN_STATS(search.backtracks += part.backtracks; search.pruned += part.pruned;)
+    }
+    size_t keep = std::min(search.k, search.heap.size());
+    std::partial_sort(search.heap.begin(), search.heap.begin() + keep, search.heap.end());
+    search.heap.resize(keep);
+}
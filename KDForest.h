@@ -0,0 +1,62 @@
+#ifndef KD_FOREST_H
+#define KD_FOREST_H
+
+#include "KD_Tree.h"
+#include "LabelTable.h"
+#include "ThreadPool.h"
+#include "kNN_Data.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// The points spread over several independent KD-trees (shards) that are built in parallel
+// and searched concurrently. Rows are dealt out round robin, so every shard covers the
+// whole space at a fraction of the density and the shards of one query take about equally
+// long. The per-shard top-k lists are merged into one; while they run, the shards share
+// the lowest k-th distance any of them has reached (KDTreeQuery::shared_bound), which no
+// point outside the final result can beat, so later shards prune like one big search would.
+//
+// Rows are numbered across the shards: shard s holds rows getRowOffset(s) .. getRowOffset(s + 1).
+class KDForest {
+private:
+    std::vector<KD_Tree> shards;
+    std::vector<uint32_t> row_offsets; // first row of every shard, then the row count
+    std::vector<uint32_t> label_ids;   // label id of every row, in the source's label table
+    LabelTable labels;
+    double split_threshold; // leaf size as for one tree over all rows, see KD_Tree::leafSizeFor
+    size_t shard_count;     // shards of the next build, 0 means one per hardware thread
+    std::unique_ptr<ThreadPool> pool; // builds the shards, then runs their searches
+
+    // Deals rowCount rows out to the shards and builds them, fill(row, features) gives the
+    // features of source row row, sourceLabels[row] its label id
+    template <typename Fill>
+    void buildShards(size_t rowCount, size_t dims, const Fill& fill, const std::vector<uint32_t>& sourceLabels);
+
+public:
+    KDForest(double threshold = 0.1, size_t shardCount = 0);
+
+    void setShardCount(size_t shardCount); // takes effect on the next build
+    size_t getShardCount() const;          // shards of the current build
+
+    void build(const ColumnarDataset& data);
+    void build(const KD_Tree& tree); // indexes the live points of tree, label ids stay the same
+    void clear();
+
+    const KD_Tree& getShard(size_t shard) const;
+    uint32_t getRowOffset(size_t shard) const;
+    Point getPoint(uint32_t row) const;
+    const std::string& getLabel(uint32_t row) const;
+    uint32_t getLabelId(uint32_t row) const;
+    const LabelTable& getLabels() const;
+    size_t size() const;
+
+    // On return search.heap holds the merged neighbors, (squared distance, row) in ascending order,
+    // and the counters add up the work of all shards. With concurrent set the shards are searched
+    // on the forest's pool if it is idle, otherwise (and from inside another loop of that pool)
+    // one after the other on the calling thread. Safe to run from many threads at once.
+    void kNN(KDTreeQuery& search, bool concurrent = true) const;
+};
+
+#endif // KD_FOREST_H
@@ -1,57 +1,31 @@
 #ifndef KD_TREE_NODES_H
 #define KD_TREE_NODES_H
 
-#include "kNN_Data.h"
-#include <string>
-#include <vector>
-
-// Base Node Class
-class KDTreeNode {
-public:
-    virtual ~KDTreeNode()  {}; // virtual destructor
-    virtual bool isLeaf() const = 0; // returns if the node is a leaf node or not
-
-};
-
-class kd_tree_inter_node : public KDTreeNode {
-public:
-    int split_dimension;
-    double split_value;
-    KDTreeNode* left;
-    KDTreeNode* right;
-
-    // Constructor declaration etc
-    kd_tree_inter_node(int split_dimension, double split_value)
-            : split_dimension(split_dimension), split_value(split_value), left(nullptr), right(nullptr) {}
-
-    bool isLeaf() const override {
-        return false;
+#include <cstdint>
+
+// Flat KD-Tree node, stored by value in KD_Tree::nodes and addressed by index.
+// Internal nodes hold the split plane and the indices of their children,
+// leaf nodes hold a [begin, end) range into the tree's shared point buffer.
+struct KDTreeNode {
+    double split_value;     // split coordinate (internal nodes only)
+    int32_t split_dimension; // split feature index, -1 marks a leaf
+    uint32_t left;          // internal: left child index,  leaf: first point index
+    uint32_t right;         // internal: right child index, leaf: one past the last point index
+
+    static KDTreeNode makeInternal(int dimension, double value) {
+        return KDTreeNode{value, dimension, 0, 0};
     }
 
-    ~kd_tree_inter_node() override {
-
+    static KDTreeNode makeLeaf(uint32_t begin, uint32_t end) {
+        return KDTreeNode{0.0, -1, begin, end};
     }
 
-
-};
-
-// Leaf Node Class
-class kd_tree_leaf_node : public KDTreeNode {
-public:
-    // Members:
-    Dataset data;
-
-    // Constructor declaration
-    kd_tree_leaf_node(Dataset dataLabelPairs) : data(dataLabelPairs) {}
-
-    // Overridden virtual methods
-    bool isLeaf() const override {
-        return true; // Leaf node
+    bool isLeaf() const {
+        return split_dimension < 0;
     }
 
-    ~kd_tree_leaf_node() override {
-
-    }
+    uint32_t begin() const { return left; }  // leaf range accessors
+    uint32_t end() const { return right; }
 };
 
-#endif // KD_TREE_NODES_H
\ No newline at end of file
+#endif // KD_TREE_NODES_H
@@ -1,152 +1,922 @@
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <thread>
 #include "KD_Tree.h"
 #include "KDT_Node.h"
+#include "DistanceKernels.h"
 
 // Default constructor implementation
-KD_Tree::KD_Tree() : root(nullptr), split_threshold(0.1) {
+KD_Tree::KD_Tree() : feature_storage(STORAGE_FLOAT64), rerank_factor(4), split_threshold(0.1), leaf_size(1),
+                     parallel_build_cutoff(1 << 16), build_source_rows(nullptr), dead_rows(0), dead_nodes(0) {
 }
 
 // Parameterized constructor implementation
-KD_Tree::KD_Tree(double threshold) : root(nullptr), split_threshold(threshold) {
+KD_Tree::KD_Tree(double threshold) : feature_storage(STORAGE_FLOAT64), rerank_factor(4), split_threshold(threshold),
+                                     leaf_size(1), parallel_build_cutoff(1 << 16), build_source_rows(nullptr),
+                                     dead_rows(0), dead_nodes(0) {
 }
 
 // Destructor implementation
 KD_Tree::~KD_Tree() {
-    // Implementation for safely deleting the KD_Tree and its nodes
-//    clear(root);
+    // Nodes and points are owned by value, nothing to release by hand
 }
 
-// Helper function to recursively delete nodes
-void KD_Tree::clear(KDTreeNode* node) {
-    if (node == nullptr) {
+// Drops every node and the shared point buffer
+void KD_Tree::clear() {
+    nodes.clear();
+    subtree_sizes.clear();
+    features.clear();
+    compressed.clear();
+    label_ids.clear();
+    labels.clear();
+    backing.reset();
+    dead_rows = 0;
+    dead_nodes = 0;
+}
+
+void KD_Tree::detach() {
+    if (!backing) {
         return;
     }
+    nodes.detach();
+    subtree_sizes.detach();
+    features.detach();
+    compressed.detach();
+    label_ids.detach();
+    backing.reset();
+}
 
-    auto internalNode = dynamic_cast<kd_tree_inter_node*>(node);
-    if (internalNode) {
-        if (internalNode->left != nullptr) {
-            clear(internalNode->left);
-        }
-        if (internalNode->right != nullptr) {
-            clear(internalNode->right);
-        }
+void KD_Tree::syncCompressed(uint32_t begin, uint32_t end) {
+    if (!compressed.enabled()) {
+        return;
+    }
+    compressed.resize(features.size());
+    for (uint32_t row = begin; row < end; ++row) {
+        compressed.encodeRow(row, features, row);
     }
+}
+
+void KD_Tree::setFeatureStorage(FeatureStorage storage, size_t rerankFactor) {
+    feature_storage = storage;
+    rerank_factor = std::max<size_t>(1, rerankFactor);
+    compressed.encode(features, feature_storage);
+}
+
+FeatureStorage KD_Tree::getFeatureStorage() const {
+    return feature_storage;
+}
+
+size_t KD_Tree::getRerankFactor() const {
+    return rerank_factor;
+}
 
-    delete node;
+namespace {
+
+    // Largest bucket a fractional split_threshold can ask for. Without a cap the default 0.1 would
+    // put a tenth of the data in every leaf, so a query on 1M points would scan 100k of them.
+    const size_t max_fractional_leaf_size = 32;
+
+    // Read access to build input, by point index
+    class PointSource {
+    public:
+        explicit PointSource(const std::vector<Point>& p) : points(p) {}
+
+        size_t size() const { return points.size(); }
+        size_t dimensions() const { return points[0].features.size(); }
+        double value(uint32_t i, size_t d) const { return points[i].features[d]; }
+        const std::string& label(uint32_t i) const { return points[i].label; }
+        void copyRow(uint32_t i, FeatureMatrix& into, size_t row) const { into.setRow(row, points[i].features); }
+
+    private:
+        const std::vector<Point>& points;
+    };
+
+    class ColumnarSource {
+    public:
+        explicit ColumnarSource(const ColumnarDataset& d) : data(d) {}
+
+        size_t size() const { return data.size(); }
+        size_t dimensions() const { return data.features.dimensions(); }
+        double value(uint32_t i, size_t d) const { return data.features.at(i, d); }
+        const std::string& label(uint32_t i) const { return data.label(i); }
+        void copyRow(uint32_t i, FeatureMatrix& into, size_t row) const {
+            for (size_t d = 0; d < data.features.dimensions(); ++d) {
+                into.set(row, d, data.features.at(i, d));
+            }
+        }
+
+    private:
+        const ColumnarDataset& data;
+    };
 }
 
+size_t KD_Tree::leafSizeFor(double threshold, size_t pointCount) {
+    if (threshold <= 0.0) {
+        return 1;
+    }
+    if (threshold < 1.0) {
+        size_t fraction = static_cast<size_t>(std::ceil(threshold * pointCount));
+        return std::max<size_t>(1, std::min(fraction, max_fractional_leaf_size));
+    }
+    return static_cast<size_t>(threshold);
+}
 
+uint32_t KD_Tree::subtreeNodeCount(uint32_t pointCount) {
+    // Subtree shape only depends on the range length, and each level has at most two distinct lengths
+    auto cached = subtree_node_counts.find(pointCount);
+    if (cached != subtree_node_counts.end()) {
+        return cached->second;
+    }
 
+    uint32_t count = 1;
+    if (pointCount > leaf_size) {
+        uint32_t leftCount = pointCount / 2;
+        count += subtreeNodeCount(leftCount) + subtreeNodeCount(pointCount - leftCount);
+    }
+    subtree_node_counts[pointCount] = count;
+    return count;
+}
 
-void KD_Tree::buildRecursive(KDTreeNode*& node, std::vector<Point>& points, size_t depth) {
-    // Check if points vector is empty
-    if (points.empty()) {
-        node = nullptr;
+template <typename Source>
+void KD_Tree::buildRecursive(const Source& points, std::vector<uint32_t>& order, uint32_t nodeIndex,
+                             uint32_t rowBase, uint32_t begin, uint32_t end, size_t depth, size_t parallelDepth) {
+    subtree_sizes[nodeIndex] = end - begin;
+
+    // Small enough ranges stop splitting and become a leaf bucket, its rows are gathered into the SoA buffer
+    if (end - begin <= leaf_size) {
+        nodes[nodeIndex] = KDTreeNode::makeLeaf(rowBase + begin, rowBase + end);
+        for (uint32_t i = begin; i < end; ++i) {
+            points.copyRow(order[i], features, rowBase + i);
+            label_ids[rowBase + i] = build_label_ids[order[i]];
+            if (build_source_rows != nullptr) {
+                (*build_source_rows)[rowBase + i] = order[i];
+            }
+        }
         return;
     }
 
     // Determine the current split dimension based on the depth
-    size_t dim = depth % points[0].features.size();
+    size_t dim = depth % features.dimensions();
 
     // Calculate the median index
-    size_t medianIndex = points.size() / 2;
+    uint32_t medianIndex = begin + (end - begin) / 2;
 
-    // Find the median element along the current dimension without sorting the entire vector
-    std::nth_element(points.begin(), points.begin() + medianIndex, points.end(),
-                     [dim](const Point& a, const Point& b) {
-                         return a.features[dim] < b.features[dim];
+    // Find the median element along the current dimension, only the index permutation is reordered
+    std::nth_element(order.begin() + begin, order.begin() + medianIndex, order.begin() + end,
+                     [&points, dim](uint32_t a, uint32_t b) {
+                         return points.value(a, dim) < points.value(b, dim);
                      });
 
-    // Create a new internal node
-    node = new kd_tree_inter_node(dim, points[medianIndex].features[dim]);
-
-    // Recursively build left and right subtrees
-    std::vector<Point> leftPoints(points.begin(), points.begin() + medianIndex);
-    std::vector<Point> rightPoints(points.begin() + medianIndex + 1, points.end());
-    buildRecursive(reinterpret_cast<kd_tree_inter_node*>(node)->left, leftPoints, depth + 1);
-    buildRecursive(reinterpret_cast<kd_tree_inter_node*>(node)->right, rightPoints, depth + 1);
+    // Children sit at fixed preorder slots, so subtrees can be filled in independently
+    uint32_t left = nodeIndex + 1;
+    uint32_t right = left + subtree_node_counts.at(medianIndex - begin);
+    nodes[nodeIndex] = KDTreeNode::makeInternal(static_cast<int>(dim), points.value(order[medianIndex], dim));
+    nodes[nodeIndex].left = left;
+    nodes[nodeIndex].right = right;
+
+    // Recursively build left and right subtrees over the two halves of the range,
+    // handing the left half to another thread while the range is still large
+    if (parallelDepth > 0 && end - begin >= parallel_build_cutoff) {
+        std::thread leftBuilder(&KD_Tree::buildRecursive<Source>, this, std::cref(points), std::ref(order), left,
+                                rowBase, begin, medianIndex, depth + 1, parallelDepth - 1);
+        buildRecursive(points, order, right, rowBase, medianIndex, end, depth + 1, parallelDepth - 1);
+        leftBuilder.join();
+    } else {
+        buildRecursive(points, order, left, rowBase, begin, medianIndex, depth + 1, 0);
+        buildRecursive(points, order, right, rowBase, medianIndex, end, depth + 1, 0);
+    }
 }
 
 
 
 void KD_Tree::build(Dataset& data) {
-    std::vector<Point> points = data.points;
-    buildRecursive(root, points, 0);
+    clear();
+    if (data.points.empty()) {
+        return;
+    }
+    buildFrom(PointSource(data.points));
+}
+
+void KD_Tree::build(const ColumnarDataset& data) {
+    clear();
+    if (data.size() == 0) {
+        return;
+    }
+    buildFrom(ColumnarSource(data));
+}
+
+void KD_Tree::build(const ColumnarDataset& data, std::vector<uint32_t>& sourceRows) {
+    sourceRows.assign(data.size(), 0);
+    build_source_rows = &sourceRows;
+    build(data);
+    build_source_rows = nullptr;
+}
+
+template <typename Source>
+void KD_Tree::buildFrom(const Source& points) {
+    KNN_STATS(auto buildStart = std::chrono::steady_clock::now();)
+
+    // Partition a permutation of point indices instead of copying points around,
+    // the only other allocation is the tree's own SoA buffer
+    uint32_t pointCount = static_cast<uint32_t>(points.size());
+    std::vector<uint32_t> order(pointCount);
+    for (uint32_t i = 0; i < pointCount; ++i) {
+        order[i] = i;
+    }
+
+    leaf_size = leafSizeFor(split_threshold, pointCount);
+    features.assign(points.dimensions(), pointCount);
+    label_ids.resize(pointCount);
+    dead_rows = 0;
+    dead_nodes = 0;
+
+    // Interned up front, the build threads only copy ids
+    build_label_ids.resize(pointCount);
+    for (uint32_t i = 0; i < pointCount; ++i) {
+        build_label_ids[i] = labels.intern(points.label(i));
+    }
+
+    subtree_node_counts.clear();
+    nodes.resize(subtreeNodeCount(pointCount));
+    subtree_sizes.resize(nodes.size());
+
+    // Spawn tasks until there are about two per hardware thread
+    size_t parallelDepth = 0;
+    for (size_t threads = std::max(1u, std::thread::hardware_concurrency()); threads > 0; threads /= 2) {
+        ++parallelDepth;
+    }
+
+    buildRecursive(points, order, 0, 0, 0, pointCount, 0, parallelDepth);
+    subtree_node_counts.clear();
+    std::vector<uint32_t>().swap(build_label_ids);
+
+    compressed.encode(features, feature_storage);
+
+    KNN_STATS(SearchStats::recordBuild(getShape(), std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - buildStart).count());)
 }
 
-KDTreeNode* KD_Tree::getRoot() {
+void KD_Tree::setParallelBuildCutoff(size_t pointCount) {
+    parallel_build_cutoff = pointCount;
+}
+
+const KDTreeNode* KD_Tree::getRoot() const {
     // Implementation to return the root of the KD_Tree
-    return root;
+    return nodes.empty() ? nullptr : &nodes[0];
 }
 
-// Other member function implementations...
+const KDTreeNode& KD_Tree::getNode(uint32_t index) const {
+    return nodes[index];
+}
 
-std::vector<Point> KD_Tree::kNN(const Point& queryPoint, size_t k) {
-    std::vector<Point> nearestNeighbors;
+size_t KD_Tree::getNodeCount() const {
+    return nodes.size();
+}
 
-    // Start the search from the root of the KD-Tree
-    kNNRecursive(root, queryPoint, k, nearestNeighbors);
+const FeatureMatrix& KD_Tree::getFeatures() const {
+    return features;
+}
+
+Point KD_Tree::getPoint(uint32_t index) const {
+    return Point(features.row(index), getLabel(index));
+}
+
+const std::string& KD_Tree::getLabel(uint32_t index) const {
+    return labels.name(label_ids[index]);
+}
+
+uint32_t KD_Tree::getLabelId(uint32_t index) const {
+    return label_ids[index];
+}
+
+const LabelTable& KD_Tree::getLabels() const {
+    return labels;
+}
+
+size_t KD_Tree::size() const {
+    return features.size() - dead_rows;
+}
+
+size_t KD_Tree::getLeafSize() const {
+    return leaf_size;
+}
+
+KDTreeShape KD_Tree::getShape() const {
+    KDTreeShape shape;
+    if (nodes.empty()) {
+        return shape;
+    }
+
+    double depthSum = 0.0;
+    shape.min_leaf_points = SIZE_MAX;
+    std::vector<std::pair<uint32_t, size_t>> stack(1, std::make_pair(0u, size_t(0)));
+    while (!stack.empty()) {
+        uint32_t nodeIndex = stack.back().first;
+        size_t depth = stack.back().second;
+        stack.pop_back();
+        const KDTreeNode& node = nodes[nodeIndex];
+        ++shape.nodes;
+
+        if (node.isLeaf()) {
+            size_t count = node.end() - node.begin();
+            ++shape.leaves;
+            shape.points += count;
+            shape.max_depth = std::max(shape.max_depth, depth);
+            shape.min_leaf_points = std::min(shape.min_leaf_points, count);
+            shape.max_leaf_points = std::max(shape.max_leaf_points, count);
+            depthSum += static_cast<double>(depth) * count;
+            continue;
+        }
 
-    return nearestNeighbors;
+        uint32_t size = subtree_sizes[nodeIndex];
+        if (size > 0) {
+            double heavier = std::max(subtree_sizes[node.left], subtree_sizes[node.right]);
+            shape.max_imbalance = std::max(shape.max_imbalance, heavier / size);
+        }
+        stack.emplace_back(node.left, depth + 1);
+        stack.emplace_back(node.right, depth + 1);
+    }
+
+    shape.mean_leaf_depth = shape.points > 0 ? depthSum / shape.points : 0.0;
+    shape.leaf_fill = static_cast<double>(shape.points) / (static_cast<double>(shape.leaves) * leaf_size);
+    return shape;
 }
 
-void KD_Tree::kNNRecursive(KDTreeNode* node, const Point& queryPoint, size_t k, std::vector<Point>& neighbors) {
-    // Güvenli bir şekilde node türünü kontrol et
-    if (auto leafNode = dynamic_cast<kd_tree_leaf_node*>(node)) {
-        // node bir yaprak düğümüdür
-        if (!leafNode) {
-            return;
+void KD_Tree::insert(const Point& point) {
+    if (!nodes.empty() && point.features.size() != features.dimensions()) {
+        std::cerr << "Cannot insert a point with " << point.features.size() << " features into a tree of "
+                  << features.dimensions() << std::endl;
+        return;
+    }
+    detach();
+    if (nodes.empty()) {
+        // First point of an empty tree: a single empty leaf to grow from
+        features.assign(point.features.size(), 0);
+        compressed.encode(features, feature_storage);
+        leaf_size = leafSizeFor(split_threshold, 1);
+        nodes.push_back(KDTreeNode::makeLeaf(0, 0));
+        subtree_sizes.push_back(0);
+    }
+
+    // A fractional threshold asks for larger buckets as the tree grows, and growing them only
+    // lets existing leaves fill further, so trees built by insert alone size like trained ones
+    leaf_size = std::max(leaf_size, leafSizeFor(split_threshold, size() + 1));
+
+    // Descend the same way a query would, remembering the path for the size updates
+    std::vector<uint32_t> path;
+    uint32_t nodeIndex = 0;
+    while (true) {
+        path.push_back(nodeIndex);
+        const KDTreeNode& node = nodes[nodeIndex];
+        if (node.isLeaf()) {
+            break;
+        }
+        nodeIndex = point.features[node.split_dimension] < node.split_value ? node.left : node.right;
+    }
+
+    // A leaf's rows must stay contiguous: grow it in place when it ends the buffer, otherwise move it there first
+    KDTreeNode& leaf = nodes[nodeIndex];
+    if (leaf.end() != features.size()) {
+        uint32_t newBegin = static_cast<uint32_t>(features.appendRows(leaf.end() - leaf.begin()));
+        label_ids.resize(features.size());
+        for (uint32_t i = leaf.begin(); i < leaf.end(); ++i) {
+            features.copyRow(newBegin + (i - leaf.begin()), i);
+            label_ids[newBegin + (i - leaf.begin())] = label_ids[i];
+        }
+        dead_rows += leaf.end() - leaf.begin();
+        leaf.right = newBegin + (leaf.end() - leaf.begin());
+        leaf.left = newBegin;
+    }
+    uint32_t row = static_cast<uint32_t>(features.appendRows(1));
+    features.setRow(row, point.features);
+    label_ids.push_back(labels.intern(point.label));
+    leaf.right = row + 1;
+    syncCompressed(leaf.begin(), leaf.end());
+
+    for (uint32_t index : path) {
+        ++subtree_sizes[index];
+    }
+    rebalance(path);
+}
+
+bool KD_Tree::remove(const Point& point) {
+    if (nodes.empty() || point.features.size() != features.dimensions()) {
+        return false;
+    }
+    detach();
+
+    std::vector<uint32_t> path;
+    uint32_t row = 0;
+    if (!findRow(0, point, path, row)) {
+        return false;
+    }
+
+    // Fill the hole with the leaf's last row and shrink the leaf by one
+    KDTreeNode& leaf = nodes[path.back()];
+    uint32_t last = leaf.end() - 1;
+    if (row != last) {
+        features.copyRow(row, last);
+        label_ids[row] = label_ids[last];
+        syncCompressed(row, row + 1);
+    }
+    leaf.right = last;
+    ++dead_rows;
+
+    for (uint32_t index : path) {
+        --subtree_sizes[index];
+    }
+    rebalance(path);
+    return true;
+}
+
+bool KD_Tree::findRow(uint32_t nodeIndex, const Point& point, std::vector<uint32_t>& path, uint32_t& row) const {
+    path.push_back(nodeIndex);
+    const KDTreeNode& node = nodes[nodeIndex];
+
+    if (node.isLeaf()) {
+        for (uint32_t i = node.begin(); i < node.end(); ++i) {
+            bool same = point.label.empty() || getLabel(i) == point.label;
+            for (size_t d = 0; same && d < features.dimensions(); ++d) {
+                same = features.at(i, d) == point.features[d];
+            }
+            if (same) {
+                row = i;
+                return true;
+            }
+        }
+    } else {
+        // Points equal to the split value can sit on either side of it
+        double value = point.features[node.split_dimension];
+        if (value <= node.split_value && findRow(node.left, point, path, row)) {
+            return true;
+        }
+        if (value >= node.split_value && findRow(node.right, point, path, row)) {
+            return true;
+        }
+    }
+
+    path.pop_back();
+    return false;
+}
+
+void KD_Tree::rebalance(const std::vector<uint32_t>& path) {
+    // Scapegoat: rebuild the highest subtree on the path whose heavier child holds more than
+    // alpha of its points, or the leaf itself once it has outgrown two buckets
+    const double alpha = 0.75;
+    for (size_t depth = 0; depth < path.size(); ++depth) {
+        uint32_t nodeIndex = path[depth];
+        const KDTreeNode& node = nodes[nodeIndex];
+        uint32_t size = subtree_sizes[nodeIndex];
+        if (size <= 2 * leaf_size) {
+            continue;
+        }
+
+        bool unbalanced = node.isLeaf() ||
+                std::max(subtree_sizes[node.left], subtree_sizes[node.right]) > alpha * size;
+        if (unbalanced) {
+            rebuildSubtree(nodeIndex, depth);
+            break;
+        }
+    }
+
+    // Rebuilt subtrees leave their old rows and nodes behind, reclaim them once they dominate.
+    // The label table survives, so label ids callers got from getLabelId keep their meaning.
+    if (dead_rows > size() || dead_nodes > nodes.size() / 2) {
+        std::vector<Point> points;
+        collectPoints(0, points);
+        LabelTable kept = std::move(labels);
+        clear();
+        labels = std::move(kept);
+        if (!points.empty()) {
+            buildFrom(PointSource(points));
         }
-        // Yaprak düğümündeki tüm noktaları al
-        std::vector<Point> leafPoints = leafNode->data.points;
+    }
+}
 
-        // Query noktasından yaprak düğümündeki her noktaya olan uzaklığı hesapla
-        for (auto& leafPoint : leafPoints) {
-            double distance = queryPoint.calculateDistance(leafPoint);
-            leafPoint.features.push_back(distance); // Uzaklığı özelliklere ekleyerek sakla
+void KD_Tree::collectPoints(uint32_t nodeIndex, std::vector<Point>& points) const {
+    const KDTreeNode& node = nodes[nodeIndex];
+    if (node.isLeaf()) {
+        for (uint32_t i = node.begin(); i < node.end(); ++i) {
+            points.push_back(getPoint(i));
         }
+        return;
+    }
+    collectPoints(node.left, points);
+    collectPoints(node.right, points);
+}
+
+uint32_t KD_Tree::countNodes(uint32_t nodeIndex) const {
+    const KDTreeNode& node = nodes[nodeIndex];
+    return node.isLeaf() ? 1 : 1 + countNodes(node.left) + countNodes(node.right);
+}
+
+void KD_Tree::rebuildSubtree(uint32_t nodeIndex, size_t depth) {
+    std::vector<Point> points;
+    collectPoints(nodeIndex, points);
+    // The old rows all die; of the old nodes nodeIndex is reused below, but the new root's own slot is left orphaned
+    dead_rows += static_cast<uint32_t>(points.size());
+    dead_nodes += countNodes(nodeIndex);
+
+    // The new subtree goes to the end of the node array and the point buffer
+    uint32_t pointCount = static_cast<uint32_t>(points.size());
+    std::vector<uint32_t> order(pointCount);
+    for (uint32_t i = 0; i < pointCount; ++i) {
+        order[i] = i;
+    }
+
+    uint32_t rowBase = static_cast<uint32_t>(features.appendRows(pointCount));
+    label_ids.resize(features.size());
+    build_label_ids.resize(pointCount);
+    for (uint32_t i = 0; i < pointCount; ++i) {
+        build_label_ids[i] = labels.intern(points[i].label);
+    }
+    PointSource source(points);
+
+    subtree_node_counts.clear();
+    uint32_t nodeBase = static_cast<uint32_t>(nodes.size());
+    nodes.resize(nodeBase + subtreeNodeCount(pointCount));
+    subtree_sizes.resize(nodes.size());
+    buildRecursive(source, order, nodeBase, rowBase, 0, pointCount, depth, 0);
+    subtree_node_counts.clear();
+    std::vector<uint32_t>().swap(build_label_ids);
+    syncCompressed(rowBase, rowBase + pointCount);
+
+    // The parent still points at nodeIndex, so the new subtree root takes over that slot
+    nodes[nodeIndex] = nodes[nodeBase];
+    subtree_sizes[nodeIndex] = subtree_sizes[nodeBase];
+}
+
+// Other member function implementations...
+
+std::vector<Point> KD_Tree::kNN(const Point& queryPoint, size_t k) {
+    return kNN(queryPoint, k, KDTreeSearchOptions());
+}
+
+std::vector<Point> KD_Tree::kNN(const Point& queryPoint, size_t k, const KDTreeSearchOptions& options,
+                                size_t* nodesVisited) {
+    KDTreeQuery search(queryPoint.features.data(), k, options);
+    kNN(search);
+    if (nodesVisited != nullptr) {
+        *nodesVisited = search.nodes_visited;
+    }
+
+    std::vector<Point> result;
+    result.reserve(search.heap.size());
+    for (const auto& neighbor : search.heap) {
+        result.push_back(getPoint(neighbor.second));
+    }
+    return result;
+}
+
+size_t KD_Tree::kNN(const double* query, size_t k, KDTreeNeighbor* out, KDTreeQuery& context) const {
+    context.query = query;
+    context.k = k;
+    kNN(context);
+    for (size_t i = 0; i < context.heap.size(); ++i) {
+        out[i].index = context.heap[i].second;
+        out[i].distance = std::sqrt(context.heap[i].first);
+    }
+    return context.heap.size();
+}
+
+size_t KD_Tree::kNN(const double* query, size_t k, KDTreeNeighbor* out, const KDTreeSearchOptions& options) const {
+    static thread_local KDTreeQuery context(nullptr, 0);
+    context.options = options;
+    return kNN(query, k, out, context);
+}
 
-        // Query noktasına olan uzaklığa göre yaprak noktalarını sırala
-        std::sort(leafPoints.begin(), leafPoints.end(), [](const Point& a, const Point& b) {
-            return a.features.back() < b.features.back(); // Özelliğin son elemanı, yani uzaklık, kullanılır
-        });
+void KD_Tree::kNN(KDTreeQuery& search) const {
+    KNN_STATS(auto queryStart = std::chrono::steady_clock::now();)
+    KNN_STATS(search.backtracks = 0; search.pruned = 0;)
+    search.capacity = compressed.enabled() ? search.k * rerank_factor : search.k;
+    search.heap.clear();
+    search.heap.reserve(search.capacity);
+    search.nodes_visited = 0;
+    search.leaves_visited = 0;
+    search.distances_computed = 0;
+    if (search.distances.size() < leaf_size) {
+        search.distances.resize(leaf_size);
+    }
+    // Compressed scans rank by approximate distances, which must not bound other searches
+    if (compressed.enabled()) {
+        search.shared_bound = nullptr;
+    }
 
-        // k-en yakın komşuları neighbors vektörüne ekle
-        for (size_t i = 0; i < std::min(k, leafPoints.size()); ++i) {
-            neighbors.push_back(leafPoints[i]);
+    // Start the search from the root of the KD-Tree
+    if (!nodes.empty() && search.k > 0) {
+        kNNRecursive(0, search);
+    }
+
+    // Candidates from a compressed scan only have approximate distances, re-rank them exactly
+    if (compressed.enabled()) {
+        size_t count = search.heap.size();
+        search.candidates.resize(count);
+        if (search.distances.size() < count) {
+            search.distances.resize(count);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            search.candidates[i] = search.heap[i].second;
         }
+        DistanceKernels::squaredDistancesAt(features, search.candidates.data(), count, search.query,
+                                            search.distances.data());
+        for (size_t i = 0; i < count; ++i) {
+            search.heap[i].first = search.distances[i];
+        }
+        size_t keep = std::min(search.k, search.heap.size());
+        std::partial_sort(search.heap.begin(), search.heap.begin() + keep, search.heap.end());
+        search.heap.resize(keep);
+    } else {
+        // Turn the max-heap into ascending distance order
+        std::sort_heap(search.heap.begin(), search.heap.end());
+    }
+
+    KNN_STATS(SearchStats::recordQuery(search.nodes_visited, search.leaves_visited, search.distances_computed,
+                                       search.backtracks, search.pruned, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - queryStart).count()));)
+}
+
+void KD_Tree::scanLeaf(const KDTreeNode& leaf, KDTreeQuery& search) const {
+    size_t count = leaf.end() - leaf.begin();
+    if (search.distances.size() < count) {
+        search.distances.resize(count);
+    }
+    if (compressed.enabled()) {
+        compressed.squaredDistances(leaf.begin(), leaf.end(), search.query, search.distances.data());
+    } else {
+        DistanceKernels::squaredDistances(features, leaf.begin(), leaf.end(), search.query, search.distances.data());
+    }
+
+    search.distances_computed += count;
+
+    // Offer every point in the bucket to the bounded heap
+    for (size_t i = 0; i < count; ++i) {
+        search.offer(search.distances[i], leaf.begin() + static_cast<uint32_t>(i));
+    }
+    search.publishBound();
+}
+
+void KD_Tree::kNNRecursive(uint32_t nodeIndex, KDTreeQuery& search) const {
+    // Out of leaf budget, keep whatever has been found so far
+    if (search.options.max_leaves != 0 && search.leaves_visited >= search.options.max_leaves) {
+        return;
+    }
 
+    const KDTreeNode& node = nodes[nodeIndex];
+    ++search.nodes_visited;
+
+    if (node.isLeaf()) {
+        ++search.leaves_visited;
+        scanLeaf(node, search);
         return;
-    } else if (auto internalNode = dynamic_cast<kd_tree_inter_node*>(node)) {
-        // node bir iç düğümüdür
+    }
+
+    // Squared distance to the split plane, comparable with the heap's squared distances
+    double diff = search.query[node.split_dimension] - node.split_value;
+    double distToPlane = diff * diff;
+
+    // Visit the side of the split plane holding the query first, then the other side if it can still hold a closer point
+    uint32_t nearChild = diff < 0 ? node.left : node.right;
+    uint32_t farChild = diff < 0 ? node.right : node.left;
+
+    kNNRecursive(nearChild, search);
 
-        if (!internalNode) {
-            return;
+    // With epsilon > 0 the far side is skipped unless it could beat the k-th best by a factor of (1+epsilon)
+    double slack = 1.0 + search.options.epsilon;
+    if (distToPlane * slack * slack < search.pruneBound()) {
+        KNN_STATS(++search.backtracks;)
+        kNNRecursive(farChild, search);
+    } else {
+        KNN_STATS(++search.pruned;)
+    }
+}
+
+template <typename Visitor>
+void KD_Tree::radiusRecursive(uint32_t nodeIndex, const double* query, double squaredRadius,
+                              std::vector<double>& distances, Visitor& visit) const {
+    const KDTreeNode& node = nodes[nodeIndex];
+
+    if (node.isLeaf()) {
+        size_t count = node.end() - node.begin();
+        if (distances.size() < count) {
+            distances.resize(count);
+        }
+        DistanceKernels::squaredDistances(features, node.begin(), node.end(), query, distances.data());
+        for (size_t i = 0; i < count; ++i) {
+            if (distances[i] <= squaredRadius) {
+                visit(node.begin() + static_cast<uint32_t>(i), distances[i]);
+            }
         }
+        return;
+    }
 
-        // Split düzlemine olan uzaklığı hesapla
-        double distToPlane = std::abs(queryPoint.features[internalNode->split_dimension] - internalNode->split_value);
+    // The far side is only reachable if the ball crosses the split plane
+    double diff = query[node.split_dimension] - node.split_value;
+    uint32_t nearChild = diff < 0 ? node.left : node.right;
+    uint32_t farChild = diff < 0 ? node.right : node.left;
 
-        // Split düzlemine olan uzaklığa göre sol ve sağ alt ağaçları dolaş
-        if (queryPoint.features[internalNode->split_dimension] < internalNode->split_value) {
-            kNNRecursive(internalNode->left, queryPoint, k, neighbors);
-            if (neighbors.size() < k || distToPlane < neighbors.back().features.back()) {
-                kNNRecursive(internalNode->right, queryPoint, k, neighbors);
+    radiusRecursive(nearChild, query, squaredRadius, distances, visit);
+    if (diff * diff <= squaredRadius) {
+        radiusRecursive(farChild, query, squaredRadius, distances, visit);
+    }
+}
+
+template <typename Visitor>
+void KD_Tree::boxRecursive(uint32_t nodeIndex, const double* lower, const double* upper, Visitor& visit) const {
+    const KDTreeNode& node = nodes[nodeIndex];
+
+    if (node.isLeaf()) {
+        for (uint32_t i = node.begin(); i < node.end(); ++i) {
+            bool inside = true;
+            for (size_t d = 0; inside && d < features.dimensions(); ++d) {
+                double value = features.at(i, d);
+                inside = lower[d] <= value && value <= upper[d];
             }
-        } else {
-            kNNRecursive(internalNode->right, queryPoint, k, neighbors);
-            if (neighbors.size() < k || distToPlane < neighbors.back().features.back()) {
-                kNNRecursive(internalNode->left, queryPoint, k, neighbors);
+            if (inside) {
+                visit(i, 0.0);
             }
         }
-    } else {
-        // node geçerli bir tür değil veya nullptr'dir, hata durumunu işlemeliyiz
         return;
     }
+
+    // Left holds values <= split_value and right values >= split_value
+    if (lower[node.split_dimension] <= node.split_value) {
+        boxRecursive(node.left, lower, upper, visit);
+    }
+    if (upper[node.split_dimension] >= node.split_value) {
+        boxRecursive(node.right, lower, upper, visit);
+    }
 }
 
+void KD_Tree::radiusSearch(const double* query, double radius, const RangeCallback& callback) const {
+    if (nodes.empty() || radius < 0) {
+        return;
+    }
+    std::vector<double> distances(leaf_size);
+    radiusRecursive(0, query, radius * radius, distances, callback);
+}
 
+size_t KD_Tree::radiusSearch(const double* query, double radius, std::vector<uint32_t>& rows) const {
+    if (nodes.empty() || radius < 0) {
+        return 0;
+    }
+    size_t before = rows.size();
+    auto collect = [&rows](uint32_t row, double) { rows.push_back(row); };
+    std::vector<double> distances(leaf_size);
+    radiusRecursive(0, query, radius * radius, distances, collect);
+    return rows.size() - before;
+}
 
+size_t KD_Tree::radiusCount(const double* query, double radius) const {
+    if (nodes.empty() || radius < 0) {
+        return 0;
+    }
+    size_t count = 0;
+    auto tally = [&count](uint32_t, double) { ++count; };
+    std::vector<double> distances(leaf_size);
+    radiusRecursive(0, query, radius * radius, distances, tally);
+    return count;
+}
 
+void KD_Tree::boxSearch(const double* lower, const double* upper, const RangeCallback& callback) const {
+    if (!nodes.empty()) {
+        boxRecursive(0, lower, upper, callback);
+    }
+}
 
+size_t KD_Tree::boxSearch(const double* lower, const double* upper, std::vector<uint32_t>& rows) const {
+    if (nodes.empty()) {
+        return 0;
+    }
+    size_t before = rows.size();
+    auto collect = [&rows](uint32_t row, double) { rows.push_back(row); };
+    boxRecursive(0, lower, upper, collect);
+    return rows.size() - before;
+}
 
+size_t KD_Tree::boxCount(const double* lower, const double* upper) const {
+    if (nodes.empty()) {
+        return 0;
+    }
+    size_t count = 0;
+    auto tally = [&count](uint32_t, double) { ++count; };
+    boxRecursive(0, lower, upper, tally);
+    return count;
+}
+
+bool KD_Tree::isAttached() const {
+    return backing != nullptr;
+}
+
+void KD_Tree::writeSections(std::ostream& out, ModelFileHeader& header) const {
+    header.dimensions = features.dimensions();
+    header.rows = features.size();
+    header.node_count = nodes.size();
+    header.leaf_size = leaf_size;
+    header.dead_rows = dead_rows;
+    header.dead_nodes = dead_nodes;
+    header.label_count = labels.size();
+    header.rerank_factor = static_cast<uint32_t>(rerank_factor);
+
+    ModelFileWriter::writeSection(out, nodes.data(), nodes.size() * sizeof(KDTreeNode), header.nodes);
+    ModelFileWriter::writeSection(out, subtree_sizes.data(), subtree_sizes.size() * sizeof(uint32_t),
+                                  header.subtree_sizes);
+
+    // Columns are written without the in-memory slack, each padded to the section alignment,
+    // so in the file the column stride is the row count rounded up to the alignment
+    ModelSection column = {static_cast<uint64_t>(out.tellp()), 0};
+    header.features = column;
+    for (size_t d = 0; d < features.dimensions(); ++d) {
+        ModelFileWriter::writeSection(out, features.column(d), features.size() * sizeof(double), column);
+        if (d == 0) {
+            header.features.offset = column.offset;
+        }
+    }
+    header.features.bytes = static_cast<uint64_t>(out.tellp()) - header.features.offset;
+
+    ModelFileWriter::writeSection(out, label_ids.data(), label_ids.size() * sizeof(uint32_t), header.label_ids);
+
+    std::string names;
+    for (const auto& name : labels.getNames()) {
+        uint32_t length = static_cast<uint32_t>(name.size());
+        names.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        names.append(name);
+    }
+    ModelFileWriter::writeSection(out, names.data(), names.size(), header.label_names);
+
+    compressed.writeSections(out, header);
+}
+
+bool KD_Tree::attach(const std::shared_ptr<MappedFile>& file, const ModelFileHeader& header) {
+    static_assert(sizeof(KDTreeNode) == 24, "KDTreeNode layout is part of the model file format");
+
+    clear();
+
+    // Each column is padded to the section alignment, see writeSections
+    uint64_t columnBytes = header.rows * sizeof(double);
+    uint64_t columnStride = (columnBytes + MODEL_FILE_ALIGNMENT - 1) / MODEL_FILE_ALIGNMENT * MODEL_FILE_ALIGNMENT;
+    if (header.nodes.bytes != header.node_count * sizeof(KDTreeNode) ||
+        header.subtree_sizes.bytes != header.node_count * sizeof(uint32_t) ||
+        header.label_ids.bytes != header.rows * sizeof(uint32_t) ||
+        (header.dimensions > 0 && header.features.bytes != (header.dimensions - 1) * columnStride + columnBytes)) {
+        std::cerr << "Model file sections do not match the tree shape" << std::endl;
+        return false;
+    }
+
+    const void* nodeData = file->section(header.nodes, alignof(KDTreeNode));
+    const void* sizeData = file->section(header.subtree_sizes, alignof(uint32_t));
+    const void* featureData = file->section(header.features, alignof(double));
+    const void* labelData = file->section(header.label_ids, alignof(uint32_t));
+    const char* nameData = static_cast<const char*>(file->section(header.label_names, 1));
+    if (!nodeData || !sizeData || !featureData || !labelData || !nameData) {
+        std::cerr << "Model file sections are out of bounds or misaligned" << std::endl;
+        return false;
+    }
+
+    // The label table is tiny and needed as strings, it is the only part that gets copied
+    const char* cursor = nameData;
+    const char* namesEnd = nameData + header.label_names.bytes;
+    for (uint64_t i = 0; i < header.label_count; ++i) {
+        uint32_t length = 0;
+        if (namesEnd - cursor < static_cast<std::ptrdiff_t>(sizeof(length))) {
+            std::cerr << "Model file label table is truncated" << std::endl;
+            clear();
+            return false;
+        }
+        std::memcpy(&length, cursor, sizeof(length));
+        cursor += sizeof(length);
+        if (static_cast<uint64_t>(namesEnd - cursor) < length) {
+            std::cerr << "Model file label table is truncated" << std::endl;
+            clear();
+            return false;
+        }
+        labels.intern(std::string(cursor, length));
+        cursor += length;
+    }
+
+    nodes.attach(static_cast<const KDTreeNode*>(nodeData), header.node_count);
+    subtree_sizes.attach(static_cast<const uint32_t*>(sizeData), header.node_count);
+    features.attach(static_cast<const double*>(featureData), header.dimensions, header.rows,
+                    columnStride / sizeof(double));
+    label_ids.attach(static_cast<const uint32_t*>(labelData), header.rows);
+    leaf_size = header.leaf_size;
+    dead_rows = header.dead_rows;
+    dead_nodes = header.dead_nodes;
+    backing = file;
+
+    // Codes saved with the storage this tree is set to are read in place, so the exact columns are
+    // only paged in for the rows a search re-ranks; any other storage is encoded from the exact columns
+    if (feature_storage != STORAGE_FLOAT64 && header.feature_storage == static_cast<uint32_t>(feature_storage)) {
+        if (!compressed.attach(*file, header)) {
+            std::cerr << "Model file compressed features do not match the tree shape" << std::endl;
+            clear();
+            return false;
+        }
+        file->adviseRandomAccess(header.features);
+    } else {
+        compressed.encode(features, feature_storage);
+    }
+    return true;
+}
@@ -2,32 +2,244 @@
 #define KD_TREE_H
 
 #include "KDT_Node.h"
+#include "FeatureMatrix.h"
+#include "LabelTable.h"
+#include "MappedArray.h"
+#include "ModelFile.h"
+#include "QuantizedFeatures.h"
+#include "SearchStats.h"
 #include "kNN_Data.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <vector>
 #include <iostream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Accuracy/latency knobs for kNN searches, the defaults give exact results
+struct KDTreeSearchOptions {
+    double epsilon;     // (1+epsilon)-approximate pruning: every result is within (1+epsilon) of the true k-th distance
+    size_t max_leaves;  // stop backtracking after scanning this many leaves, 0 means no budget
+
+    KDTreeSearchOptions(double eps = 0.0, size_t leaves = 0) : epsilon(eps), max_leaves(leaves) {}
+
+    bool isExact() const { return epsilon <= 0.0 && max_leaves == 0; }
+};
+
+// One kNN result: a row of the tree's features and its Euclidean distance to the query
+struct KDTreeNeighbor {
+    uint32_t index;
+    double distance;
+};
+
+// Per-query search state: the bounded candidate heap and the leaf distance buffer
+struct KDTreeQuery {
+    const double* query;                             // query features, one per dimension
+    size_t k;                                        // number of neighbors wanted
+    size_t capacity;                                 // candidates kept while scanning, k unless they get re-ranked
+    KDTreeSearchOptions options;
+    std::vector<std::pair<double, uint32_t>> heap;   // max-heap of (squared distance, point index)
+    std::vector<double> distances;                   // squared distances of the leaf being scanned
+    std::vector<uint32_t> candidates;                // rows of the heap while they are re-ranked exactly
+
+    size_t nodes_visited;  // nodes examined by the last search, internal and leaf
+    size_t leaves_visited; // leaves scanned by the last search
+    size_t distances_computed; // point-to-point distances evaluated by the last search
+    size_t backtracks;     // far sides of split planes searched, only counted with KNN_SEARCH_STATS
+    size_t pruned;         // far sides skipped, only counted with KNN_SEARCH_STATS
+    std::vector<double> query_buffer; // query as rewritten by the index, e.g. unit length for cosine search
+    // Squared distance shared by searches of the same query over several trees (see KDForest): each
+    // lowers it to its own k-th best and prunes against the lowest, nullptr for a standalone search
+    std::atomic<double>* shared_bound;
+
+    KDTreeQuery(const double* q, size_t neighbors, const KDTreeSearchOptions& o = KDTreeSearchOptions())
+            : query(q), k(neighbors), capacity(neighbors), options(o), nodes_visited(0), leaves_visited(0),
+              distances_computed(0), backtracks(0), pruned(0), shared_bound(nullptr) {}
+
+    // Offers one point to the bounded heap, the top is the current capacity-th best
+    void offer(double distance, uint32_t index) {
+        if (heap.size() < capacity) {
+            heap.emplace_back(distance, index);
+            std::push_heap(heap.begin(), heap.end());
+        } else if (distance < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = std::make_pair(distance, index);
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    // Squared distance from which on nothing can enter the result any more
+    double pruneBound() const {
+        double bound = heap.size() < capacity ? INFINITY : heap.front().first;
+        if (shared_bound != nullptr) {
+            bound = std::min(bound, shared_bound->load(std::memory_order_relaxed));
+        }
+        return bound;
+    }
+
+    // Lowers shared_bound to the capacity-th best once the heap is full
+    void publishBound() {
+        if (shared_bound == nullptr || heap.size() < capacity) {
+            return;
+        }
+        double current = shared_bound->load(std::memory_order_relaxed);
+        while (heap.front().first < current &&
+               !shared_bound->compare_exchange_weak(current, heap.front().first, std::memory_order_relaxed)) {
+        }
+    }
+};
 
 class KD_Tree {
 private:
-    KDTreeNode* root;
+    MappedArray<KDTreeNode> nodes;  // flat node array, nodes[0] is the root
+    MappedArray<uint32_t> subtree_sizes; // live points under every node, kept up to date by insert/remove
+    FeatureMatrix features;         // shared point buffer in SoA layout, leaves reference ranges of it
+    QuantizedFeatures compressed;   // optional compressed copy of features for the kNN leaf scans
+    FeatureStorage feature_storage; // storage policy for compressed, kept across rebuilds
+    size_t rerank_factor;           // with compressed scans, rerank_factor * k candidates are re-ranked exactly
+    MappedArray<uint32_t> label_ids; // interned label of every row in features
+    LabelTable labels;               // label id <-> label
+    std::shared_ptr<MappedFile> backing; // model file the arrays above are attached to, if any
     double split_threshold; // determines when to stop splitting, ie, stop growing the tree
-    
+    size_t leaf_size;       // bucket size derived from split_threshold at build time
+    size_t parallel_build_cutoff; // ranges at least this large build their subtrees on separate threads
+    std::unordered_map<uint32_t, uint32_t> subtree_node_counts; // build-time cache: range length -> subtree node count
+    std::vector<uint32_t> build_label_ids; // build-time: interned label of every input point
+    std::vector<uint32_t>* build_source_rows; // build-time: receives the input index of every row, if requested
+    size_t dead_rows;  // rows of features no leaf references any more
+    size_t dead_nodes; // entries of nodes no longer reachable from the root
+
+    uint32_t subtreeNodeCount(uint32_t pointCount);
+    template <typename Source>
+    void buildFrom(const Source &points);
+
+    // Builds the subtree for order[begin, end) into nodes[nodeIndex ..] in preorder,
+    // its points go to rows rowBase + begin .. rowBase + end of the SoA buffer
+    template <typename Source>
+    void buildRecursive(const Source &points, std::vector<uint32_t> &order, uint32_t nodeIndex,
+                        uint32_t rowBase, uint32_t begin, uint32_t end, size_t depth, size_t parallelDepth);
+
+    // Copies everything still read from a mapped model file into owned memory before an update
+    void detach();
+
+    // Re-encodes rows [begin, end) of features into compressed after they changed
+    void syncCompressed(uint32_t begin, uint32_t end);
+
+    // Update helpers for insert/remove
+    bool findRow(uint32_t nodeIndex, const Point &point, std::vector<uint32_t> &path, uint32_t &row) const;
+    void rebalance(const std::vector<uint32_t> &path);
+    void rebuildSubtree(uint32_t nodeIndex, size_t depth);
+    void collectPoints(uint32_t nodeIndex, std::vector<Point> &points) const;
+    uint32_t countNodes(uint32_t nodeIndex) const;
+
+    // Range search cores, visit(row, squaredDistance) is called for every match
+    template <typename Visitor>
+    void radiusRecursive(uint32_t nodeIndex, const double *query, double squaredRadius,
+                         std::vector<double> &distances, Visitor &visit) const;
+    template <typename Visitor>
+    void boxRecursive(uint32_t nodeIndex, const double *lower, const double *upper, Visitor &visit) const;
+
 public:
-    
+
     KD_Tree(); // default constructor, sets the split_threshold to 0.1
     KD_Tree(double split_threshold); // parameterized constructor - split_threshold
     ~KD_Tree();
 
+    // Declaring the destructor suppresses the implicit moves, without these a move would copy
+    // every array, and KNN::load and KDForest's shard vector move trees around
+    KD_Tree(const KD_Tree&) = default;
+    KD_Tree(KD_Tree&&) = default;
+    KD_Tree& operator=(const KD_Tree&) = default;
+    KD_Tree& operator=(KD_Tree&&) = default;
+
     void build(Dataset& data);
-    KDTreeNode* getRoot();
+    void build(const ColumnarDataset& data);
+    // Same, sourceRows[row] receives the index in data of the point stored at row
+    void build(const ColumnarDataset& data, std::vector<uint32_t>& sourceRows);
+    const KDTreeNode* getRoot() const;
+    const KDTreeNode& getNode(uint32_t index) const;
+    size_t getNodeCount() const; // entries of the node array, including ones updates left unreachable
+    const FeatureMatrix& getFeatures() const;
+    Point getPoint(uint32_t index) const;
+    const std::string& getLabel(uint32_t index) const;
+    uint32_t getLabelId(uint32_t index) const;
+    const LabelTable& getLabels() const;
+    size_t size() const;
+    size_t getLeafSize() const; // bucket size of the last build or loaded model
 
-    void buildRecursive(KDTreeNode *&node, std::vector<Point> &points, size_t depth);
+    // Depth, leaf fill and balance of the tree as it is now (after updates, not just the last build)
+    KDTreeShape getShape() const;
+
+    void setParallelBuildCutoff(size_t pointCount);
+
+    // Scans leaves on a float32 or int16/int8-quantized copy of the features and re-ranks the
+    // best rerankFactor * k candidates with exact distances. STORAGE_FLOAT64 scans the exact columns.
+    // The policy survives builds and attach(); the exact columns stay, so the compressed copy only
+    // saves memory once the tree is attached to a model file holding its codes.
+    void setFeatureStorage(FeatureStorage storage, size_t rerankFactor = 4);
+    FeatureStorage getFeatureStorage() const;
+    size_t getRerankFactor() const;
+
+    // Points per leaf bucket: a threshold below 1 is a fraction of the dataset capped at 32 points,
+    // so the default stays a small bucket on large sets; 1 and above is an exact point count
+    static size_t leafSizeFor(double split_threshold, size_t pointCount);
 
     std::vector<Point> kNN(const Point &queryPoint, size_t k);
 
-    void kNNRecursive(KDTreeNode *node, const Point &queryPoint, size_t k, std::vector<Point> &nearestNeighbors);
+    // Approximate search, nodesVisited (if given) receives the number of nodes examined
+    std::vector<Point> kNN(const Point &queryPoint, size_t k, const KDTreeSearchOptions &options,
+                           size_t *nodesVisited = nullptr);
+
+    // Read-only search with caller-owned state, safe to run from many threads at once.
+    // On return search.heap holds the neighbors in ascending distance order.
+    void kNN(KDTreeQuery &search) const;
+
+    // Allocation-free search: writes up to k neighbors of query to out[0 ..], nearest first,
+    // and returns how many were written. context carries the heap and leaf buffer between
+    // calls; once they have grown to size, a query makes no heap allocations.
+    size_t kNN(const double *query, size_t k, KDTreeNeighbor *out, KDTreeQuery &context) const;
+    // Same with a context owned by the calling thread
+    size_t kNN(const double *query, size_t k, KDTreeNeighbor *out,
+               const KDTreeSearchOptions &options = KDTreeSearchOptions()) const;
+
+    void kNNRecursive(uint32_t nodeIndex, KDTreeQuery &search) const;
+
+    // Offers the rows of a leaf to the search heap using the vectorized distance kernels
+    void scanLeaf(const KDTreeNode &leaf, KDTreeQuery &search) const;
+
+    // Range queries. Matches are reported as row indices into getFeatures()/getLabel(),
+    // which stay valid until the next build, insert or remove.
+    typedef std::function<void(uint32_t row, double squaredDistance)> RangeCallback;
+
+    // Every point within radius (inclusive) of query
+    void radiusSearch(const double *query, double radius, const RangeCallback &callback) const;
+    size_t radiusSearch(const double *query, double radius, std::vector<uint32_t> &rows) const; // appends, returns the match count
+    size_t radiusCount(const double *query, double radius) const;
+
+    // Every point with lower[d] <= feature[d] <= upper[d] in all dimensions, squaredDistance is reported as 0
+    void boxSearch(const double *lower, const double *upper, const RangeCallback &callback) const;
+    size_t boxSearch(const double *lower, const double *upper, std::vector<uint32_t> &rows) const;
+    size_t boxCount(const double *lower, const double *upper) const;
+
+    // Incremental updates, amortized O(log n): the touched leaf changes in place and
+    // subtrees are only rebuilt (scapegoat-style) once they fall out of balance. Label ids stay
+    // stable across the rebuilds. Points whose feature count differs from the tree's are rejected.
+    // The bucket size follows split_threshold for the live point count, as for build().
+    void insert(const Point &point);
+    bool remove(const Point &point); // an empty label matches any label, false if the point is not in the tree
+
+    void clear();
 
-    void clear(KDTreeNode *node);
+    // Model file support: writes the tree's sections and records them in header,
+    // or serves queries straight from the sections of a mapped file
+    void writeSections(std::ostream &out, ModelFileHeader &header) const;
+    bool attach(const std::shared_ptr<MappedFile> &file, const ModelFileHeader &header);
+    bool isAttached() const;
 };
 
-#endif // KD_TREE_H
\ No newline at end of file
+#endif // KD_TREE_H
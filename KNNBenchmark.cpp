@@ -0,0 +1,543 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <sys/resource.h>
+#include "KNNBenchmark.h"
+#include "kNN.h"
+
+namespace {
+
+    std::atomic<uint64_t> allocation_count(0);
+    std::atomic<uint64_t> allocation_bytes(0);
+
+    const size_t CLUSTERS = 16;
+    const double CLUSTER_SPREAD = 0.03;
+
+    uint64_t nanosecondsSince(std::chrono::steady_clock::time_point start) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+
+    // Starts a new resident set high-water mark; Linux only, elsewhere the process peak stays
+    void resetPeakRss() {
+        std::ofstream clearRefs("/proc/self/clear_refs");
+        if (clearRefs) {
+            clearRefs << "5";
+        }
+    }
+
+    size_t peakRssKb() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) {
+                return std::stoul(line.substr(6));
+            }
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<size_t>(usage.ru_maxrss);
+    }
+
+    // Times one phase: wall clock, peak RSS and allocations between start() and finish()
+    class PhaseMeter {
+    private:
+        std::chrono::steady_clock::time_point begin;
+        uint64_t allocations;
+        uint64_t bytes;
+
+    public:
+        std::vector<uint64_t> latencies; // one per operation, in nanoseconds
+
+        // Reserves the latencies up front so recording them allocates nothing inside the phase
+        void start(size_t operations) {
+            latencies.clear();
+            latencies.reserve(operations);
+            resetPeakRss();
+            allocations = allocation_count.load(std::memory_order_relaxed);
+            bytes = allocation_bytes.load(std::memory_order_relaxed);
+            begin = std::chrono::steady_clock::now();
+        }
+
+        BenchmarkResult finish(const BenchmarkCase& setup, const char* phase, size_t operations) {
+            BenchmarkResult result;
+            result.seconds = nanosecondsSince(begin) * 1e-9;
+            result.allocations = allocation_count.load(std::memory_order_relaxed) - allocations;
+            result.allocated_bytes = allocation_bytes.load(std::memory_order_relaxed) - bytes;
+            result.peak_rss_kb = peakRssKb();
+            result.setup = setup;
+            result.phase = phase;
+            result.operations = operations;
+            result.throughput = result.seconds > 0.0 ? operations / result.seconds : 0.0;
+
+            std::sort(latencies.begin(), latencies.end());
+            result.p50_ns = percentile(50);
+            result.p90_ns = percentile(90);
+            result.p99_ns = percentile(99);
+            result.max_ns = latencies.empty() ? 0 : latencies.back();
+            return result;
+        }
+
+        // Nearest-rank percentile of the sorted latencies
+        uint64_t percentile(double p) const {
+            if (latencies.empty()) {
+                return 0;
+            }
+            size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * latencies.size()));
+            return latencies[std::max<size_t>(rank, 1) - 1];
+        }
+    };
+}
+
+KNNBenchmark::KNNBenchmark(size_t kValue, double threshold)
+        : k(kValue), split_threshold(threshold), query_count(10000), repeats(3), seed(5489), thread_count(0) {}
+
+void KNNBenchmark::addCase(BenchmarkDistribution distribution, size_t points, size_t dims) {
+    BenchmarkCase setup;
+    setup.distribution = distribution;
+    setup.points = points;
+    setup.dims = dims;
+    cases.push_back(setup);
+}
+
+void KNNBenchmark::addGrid(const std::vector<BenchmarkDistribution>& distributions,
+                           const std::vector<size_t>& pointCounts, const std::vector<size_t>& dimensions) {
+    for (BenchmarkDistribution distribution : distributions) {
+        for (size_t dims : dimensions) {
+            for (size_t points : pointCounts) {
+                addCase(distribution, points, dims);
+            }
+        }
+    }
+}
+
+void KNNBenchmark::setQueryCount(size_t queries) {
+    query_count = queries;
+}
+
+void KNNBenchmark::setRepeats(size_t count) {
+    repeats = std::max<size_t>(1, count);
+}
+
+void KNNBenchmark::setSeed(uint32_t value) {
+    seed = value;
+}
+
+void KNNBenchmark::setThreadCount(size_t threads) {
+    thread_count = threads;
+}
+
+void KNNBenchmark::generate(const BenchmarkCase& setup, uint32_t seed, ColumnarDataset& out) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> spread(0.0, CLUSTER_SPREAD);
+
+    // The cluster centers only depend on the case, so queries land in the same clusters as the points
+    std::mt19937 centerRandom(static_cast<uint32_t>(setup.dims * 7919 + CLUSTERS));
+    std::uniform_real_distribution<double> inner(0.1, 0.9);
+    std::vector<double> centers(CLUSTERS * setup.dims);
+    for (double& center : centers) {
+        center = inner(centerRandom);
+    }
+
+    out = ColumnarDataset();
+    out.features.assign(setup.dims, setup.points);
+    out.label_ids.resize(setup.points);
+    uint32_t habitable = out.labels.intern("Habitable");
+    uint32_t uninhabitable = out.labels.intern("Uninhabitable");
+    for (size_t d = 0; d < setup.dims; ++d) {
+        out.header.push_back("f" + std::to_string(d));
+    }
+    out.header.push_back("Class");
+    out.threshold = 0.1;
+
+    for (size_t row = 0; row < setup.points; ++row) {
+        bool positive = false;
+        if (setup.distribution == DISTRIBUTION_CLUSTERED) {
+            size_t cluster = static_cast<size_t>(unit(random) * CLUSTERS) % CLUSTERS;
+            for (size_t d = 0; d < setup.dims; ++d) {
+                double value = centers[cluster * setup.dims + d] + spread(random);
+                out.features.set(row, d, std::min(1.0, std::max(0.0, value)));
+            }
+            positive = cluster % 2 == 0;
+        } else {
+            for (size_t d = 0; d < setup.dims; ++d) {
+                double value = unit(random);
+                out.features.set(row, d, setup.distribution == DISTRIBUTION_SKEWED ? std::pow(value, 4.0) : value);
+            }
+            // The median of the first feature splits the classes
+            double median = setup.distribution == DISTRIBUTION_SKEWED ? 0.0625 : 0.5;
+            positive = out.features.at(row, 0) < median;
+        }
+        out.label_ids[row] = positive ? habitable : uninhabitable;
+    }
+}
+
+std::vector<BenchmarkResult> KNNBenchmark::run() const {
+    std::vector<BenchmarkResult> results;
+    for (const BenchmarkCase& setup : cases) {
+        if (setup.points == 0 || setup.dims == 0) {
+            std::cerr << "Skipping benchmark case without points or dimensions" << std::endl;
+            continue;
+        }
+        runCase(setup, results);
+    }
+    return results;
+}
+
+void KNNBenchmark::runCase(const BenchmarkCase& setup, std::vector<BenchmarkResult>& results) const {
+    ColumnarDataset data;
+    ColumnarDataset queryData;
+    generate(setup, seed, data);
+    generate(BenchmarkCase{setup.distribution, query_count, setup.dims}, seed + 1, queryData);
+    std::vector<Point> queries;
+    queries.reserve(query_count);
+    for (size_t i = 0; i < query_count; ++i) {
+        queries.push_back(queryData.point(i));
+    }
+
+    PhaseMeter meter;
+
+    // KD_Tree on the raw features
+    KD_Tree tree(split_threshold);
+    meter.start(repeats);
+    for (size_t r = 0; r < repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        tree.build(data);
+        meter.latencies.push_back(nanosecondsSince(start));
+    }
+    results.push_back(meter.finish(setup, "tree_build", repeats));
+
+    // Warm the context once so the timed queries run allocation-free
+    KDTreeQuery context(nullptr, k);
+    std::vector<KDTreeNeighbor> neighbors(k);
+    tree.kNN(queries[0].features.data(), k, neighbors.data(), context);
+    meter.start(queries.size());
+    for (const Point& query : queries) {
+        auto start = std::chrono::steady_clock::now();
+        tree.kNN(query.features.data(), k, neighbors.data(), context);
+        meter.latencies.push_back(nanosecondsSince(start));
+    }
+    results.push_back(meter.finish(setup, "tree_knn", queries.size()));
+
+    // KNN end to end: scaling, the tree and the vote, pinned to the KD-tree so releases compare alike
+    KNN model(static_cast<int>(k), split_threshold);
+    model.setThreadCount(thread_count);
+    model.setBackend(BACKEND_KD_TREE);
+    meter.start(repeats);
+    for (size_t r = 0; r < repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        model.train(data);
+        meter.latencies.push_back(nanosecondsSince(start));
+    }
+    results.push_back(meter.finish(setup, "knn_train", repeats));
+
+    model.prepare();
+    size_t positives = 0;
+    meter.start(queries.size());
+    for (const Point& query : queries) {
+        auto start = std::chrono::steady_clock::now();
+        positives += model.predict(query);
+        meter.latencies.push_back(nanosecondsSince(start));
+    }
+    results.push_back(meter.finish(setup, "knn_predict", queries.size()));
+
+    meter.start(1);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> labels = model.predictBatch(queries);
+    meter.latencies.push_back(nanosecondsSince(start));
+    results.push_back(meter.finish(setup, "knn_predict_batch", queries.size()));
+
+    // Keeps the predictions observable, and the two paths should agree anyway
+    size_t batchPositives = std::count(labels.begin(), labels.end(), 1);
+    if (batchPositives != positives) {
+        std::cerr << "predict and predictBatch disagree on " << setup.points << " x " << setup.dims << " "
+                  << distributionName(setup.distribution) << std::endl;
+    }
+}
+
+bool KNNBenchmark::checkAllocations(std::ostream& out) const {
+    out << "distribution,points,dims,path,queries,allocations\n";
+    bool clean = true;
+
+    for (const BenchmarkCase& setup : cases) {
+        ColumnarDataset data;
+        ColumnarDataset queryData;
+        generate(setup, seed, data);
+        generate(BenchmarkCase{setup.distribution, query_count, setup.dims}, seed + 1, queryData);
+        std::vector<Point> queries;
+        queries.reserve(query_count);
+        for (size_t i = 0; i < query_count; ++i) {
+            queries.push_back(queryData.point(i));
+        }
+
+        // Runs search over every query twice and counts the allocations of the second pass
+        auto check = [&](const char* path, const std::function<void(const Point&)>& search) {
+            for (const Point& query : queries) {
+                search(query);
+            }
+            uint64_t before = allocation_count.load(std::memory_order_relaxed);
+            for (const Point& query : queries) {
+                search(query);
+            }
+            uint64_t allocations = allocation_count.load(std::memory_order_relaxed) - before;
+            out << distributionName(setup.distribution) << "," << setup.points << "," << setup.dims << ","
+                << path << "," << queries.size() << "," << allocations << "\n";
+            clean = clean && allocations == 0;
+        };
+
+        KD_Tree tree(split_threshold);
+        tree.build(data);
+        KDTreeQuery context(nullptr, k);
+        std::vector<KDTreeNeighbor> neighbors(k);
+        auto treeSearch = [&](const Point& query) {
+            tree.kNN(query.features.data(), k, neighbors.data(), context);
+        };
+        check("tree_knn", treeSearch);
+        tree.setFeatureStorage(STORAGE_INT8);
+        check("tree_knn_int8", treeSearch);
+
+        KNN model(static_cast<int>(k), split_threshold);
+        model.setThreadCount(thread_count);
+        model.train(data);
+        uint32_t sink = 0;
+        auto classify = [&](const Point& query) {
+            sink += model.classify(query).label_id;
+        };
+        const KNNBackend backends[] = {BACKEND_KD_TREE, BACKEND_BRUTE_FORCE, BACKEND_BALL_TREE};
+        const char* names[] = {"classify_kd_tree", "classify_brute_force", "classify_ball_tree"};
+        for (size_t i = 0; i < 3; ++i) {
+            model.setBackend(backends[i]);
+            model.prepare();
+            check(names[i], classify);
+        }
+        if (sink == LabelTable::NOT_FOUND) {
+            std::cerr << "No labels voted on " << setup.points << " x " << setup.dims << std::endl;
+        }
+    }
+    return clean;
+}
+
+bool KNNBenchmark::checkIncrementalBuild(std::ostream& out) const {
+    out << "distribution,points,dims,expected_leaf_size,leaf_size,leaves,built_leaves\n";
+    bool matches = true;
+
+    for (const BenchmarkCase& setup : cases) {
+        ColumnarDataset data;
+        generate(setup, seed, data);
+
+        KD_Tree built(split_threshold);
+        built.build(data);
+        KD_Tree grown(split_threshold);
+        for (size_t i = 0; i < data.size(); ++i) {
+            grown.insert(data.point(i));
+        }
+
+        size_t expected = KD_Tree::leafSizeFor(split_threshold, data.size());
+        KDTreeShape grownShape = grown.getShape();
+        KDTreeShape builtShape = built.getShape();
+        out << distributionName(setup.distribution) << "," << setup.points << "," << setup.dims << ","
+            << expected << "," << grown.getLeafSize() << "," << grownShape.leaves << "," << builtShape.leaves << "\n";
+        matches = matches && grown.getLeafSize() == expected && grown.size() == data.size() &&
+                  grownShape.leaves <= 4 * builtShape.leaves;
+    }
+    return matches;
+}
+
+const char* KNNBenchmark::distributionName(BenchmarkDistribution distribution) {
+    switch (distribution) {
+        case DISTRIBUTION_CLUSTERED:
+            return "clustered";
+        case DISTRIBUTION_SKEWED:
+            return "skewed";
+        default:
+            return "uniform";
+    }
+}
+
+bool KNNBenchmark::parseDistribution(const std::string& name, BenchmarkDistribution& out) {
+    const BenchmarkDistribution all[] = {DISTRIBUTION_UNIFORM, DISTRIBUTION_CLUSTERED, DISTRIBUTION_SKEWED};
+    for (BenchmarkDistribution distribution : all) {
+        if (name == distributionName(distribution)) {
+            out = distribution;
+            return true;
+        }
+    }
+    return false;
+}
+
+void KNNBenchmark::report(std::ostream& out, const std::vector<BenchmarkResult>& results) {
+    out << "distribution,points,dims,phase,operations,seconds,ops_per_second,p50_ns,p90_ns,p99_ns,max_ns,"
+           "peak_rss_kb,allocations,allocated_bytes\n";
+    for (const BenchmarkResult& result : results) {
+        out << distributionName(result.setup.distribution) << "," << result.setup.points << ","
+            << result.setup.dims << "," << result.phase << "," << result.operations << "," << result.seconds
+            << "," << result.throughput << "," << result.p50_ns << "," << result.p90_ns << ","
+            << result.p99_ns << "," << result.max_ns << "," << result.peak_rss_kb << ","
+            << result.allocations << "," << result.allocated_bytes << "\n";
+    }
+}
+
+void KNNBenchmark::countAllocation(size_t bytes) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+#if KNN_BENCHMARK_MAIN
+// Benchmark executable, built with -DKNN_BENCHMARK_MAIN=1 together with the library sources:
+//   knn_benchmark [--distributions uniform,clustered,skewed] [--points 10000,100000] [--dims 2,8]
+//                 [--queries 10000] [--k 5] [--threshold 0.1] [--repeats 3] [--seed 5489] [--threads 0]
+//                 [--check-allocations] [--check-updates]
+// and writes the CSV report to standard output. With --check-allocations it runs checkAllocations
+// on the same cases instead and exits with status 1 if any steady-state query allocated;
+// --check-updates does the same with checkIncrementalBuild.
+
+// GCC takes the free() below for a mismatch once it inlines the replaced operator new into callers
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t bytes) {
+    KNNBenchmark::countAllocation(bytes);
+    if (void* memory = std::malloc(bytes ? bytes : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t bytes) {
+    return operator new(bytes);
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+
+    std::vector<std::string> splitList(const std::string& list) {
+        std::vector<std::string> items;
+        std::stringstream stream(list);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            if (!item.empty()) {
+                items.push_back(item);
+            }
+        }
+        return items;
+    }
+
+    std::vector<size_t> parseSizes(const std::string& list) {
+        std::vector<size_t> sizes;
+        for (const std::string& item : splitList(list)) {
+            sizes.push_back(std::stoul(item));
+        }
+        return sizes;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::vector<BenchmarkDistribution> distributions = {DISTRIBUTION_UNIFORM, DISTRIBUTION_CLUSTERED,
+                                                        DISTRIBUTION_SKEWED};
+    std::vector<size_t> pointCounts = {10000, 100000};
+    std::vector<size_t> dimensions = {2, 8};
+    size_t queries = 10000;
+    size_t k = 5;
+    double threshold = 0.1;
+    size_t repeats = 3;
+    uint32_t seed = 5489;
+    size_t threads = 0;
+    bool checkOnly = false;
+    bool checkUpdates = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "--check-allocations") {
+            checkOnly = true;
+            continue;
+        }
+        if (option == "--check-updates") {
+            checkUpdates = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            std::cerr << "Missing value for " << option << std::endl;
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (option == "--distributions") {
+            distributions.clear();
+            for (const std::string& name : splitList(value)) {
+                BenchmarkDistribution distribution;
+                if (!KNNBenchmark::parseDistribution(name, distribution)) {
+                    std::cerr << "Unknown distribution: " << name << std::endl;
+                    return 1;
+                }
+                distributions.push_back(distribution);
+            }
+        } else if (option == "--points") {
+            pointCounts = parseSizes(value);
+        } else if (option == "--dims") {
+            dimensions = parseSizes(value);
+        } else if (option == "--queries") {
+            queries = std::stoul(value);
+        } else if (option == "--k") {
+            k = std::stoul(value);
+        } else if (option == "--threshold") {
+            threshold = std::stod(value);
+        } else if (option == "--repeats") {
+            repeats = std::stoul(value);
+        } else if (option == "--seed") {
+            seed = static_cast<uint32_t>(std::stoul(value));
+        } else if (option == "--threads") {
+            threads = std::stoul(value);
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+    if (queries == 0 || k == 0) {
+        std::cerr << "Need at least one query and k > 0" << std::endl;
+        return 1;
+    }
+
+    KNNBenchmark benchmark(k, threshold);
+    benchmark.addGrid(distributions, pointCounts, dimensions);
+    benchmark.setQueryCount(queries);
+    benchmark.setRepeats(repeats);
+    benchmark.setSeed(seed);
+    benchmark.setThreadCount(threads);
+    if (checkOnly || checkUpdates) {
+        bool passed = true;
+        if (checkOnly) {
+            passed = benchmark.checkAllocations(std::cout) && passed;
+        }
+        if (checkUpdates) {
+            passed = benchmark.checkIncrementalBuild(std::cout) && passed;
+        }
+        return passed ? 0 : 1;
+    }
+    KNNBenchmark::report(std::cout, benchmark.run());
+    return 0;
+}
+#endif
@@ -0,0 +1,104 @@
+#ifndef KNN_BENCHMARK_H
+#define KNN_BENCHMARK_H
+
+#include "kNN_Data.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Shape of the synthetic points of a benchmark case, all in [0, 1] per feature
+enum BenchmarkDistribution {
+    DISTRIBUTION_UNIFORM,
+    DISTRIBUTION_CLUSTERED, // tight Gaussian blobs around a few random centers
+    DISTRIBUTION_SKEWED     // every feature u^4, most points crowd the origin, a long thin tail
+};
+
+struct BenchmarkCase {
+    BenchmarkDistribution distribution;
+    size_t points;
+    size_t dims;
+};
+
+// Measurements of one phase of one case
+struct BenchmarkResult {
+    BenchmarkCase setup;
+    std::string phase;      // tree_build, tree_knn, knn_train, knn_predict or knn_predict_batch
+    size_t operations;      // builds, trainings or queries timed
+    double seconds;         // all operations together
+    double throughput;      // operations per second
+    uint64_t p50_ns;        // latency percentiles of single operations
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+    size_t peak_rss_kb;     // resident set high-water mark during the phase, the process peak where it cannot be reset
+    uint64_t allocations;   // heap allocations during the phase, 0 unless the allocation hook is installed
+    uint64_t allocated_bytes;
+};
+
+// Build and query scaling benchmark for KD_Tree and KNN on synthetic data. Every case is a
+// (distribution, point count, dimension) triple; each runs the same phases on a dataset and
+// a query set drawn from the same distribution with fixed seeds, so runs are comparable
+// between releases. Results are one CSV line per (case, phase).
+//
+// Allocations are counted by whatever calls countAllocation; the driver built with
+// -DKNN_BENCHMARK_MAIN (see KNNBenchmark.cpp) replaces global operator new to do so, and
+// with --check-allocations runs checkAllocations instead, failing if any query allocated.
+// --check-updates runs checkIncrementalBuild the same way.
+class KNNBenchmark {
+private:
+    std::vector<BenchmarkCase> cases;
+    size_t k;
+    double split_threshold;
+    size_t query_count;
+    size_t repeats;     // builds and trainings per case, their latencies are percentiles over these
+    uint32_t seed;
+    size_t thread_count; // KNN workers for train and predictBatch, 0 means one per hardware thread
+
+    void runCase(const BenchmarkCase& setup, std::vector<BenchmarkResult>& results) const;
+
+public:
+    KNNBenchmark(size_t k = 5, double threshold = 0.1);
+
+    void addCase(BenchmarkDistribution distribution, size_t points, size_t dims);
+    // Every combination of the given distributions, point counts and dimensions
+    void addGrid(const std::vector<BenchmarkDistribution>& distributions, const std::vector<size_t>& pointCounts,
+                 const std::vector<size_t>& dimensions);
+
+    void setQueryCount(size_t queries);
+    void setRepeats(size_t count);
+    void setSeed(uint32_t value);
+    void setThreadCount(size_t threads);
+
+    std::vector<BenchmarkResult> run() const;
+
+    // Points of a case, labelled "Habitable" or "Uninhabitable" about half and half
+    static void generate(const BenchmarkCase& setup, uint32_t seed, ColumnarDataset& out);
+
+    static const char* distributionName(BenchmarkDistribution distribution);
+    // Inverse of distributionName, false for unknown names
+    static bool parseDistribution(const std::string& name, BenchmarkDistribution& out);
+
+    // Machine-readable results, one CSV line per result after a header line
+    static void report(std::ostream& out, const std::vector<BenchmarkResult>& results);
+
+    // Steady-state allocation check for every case: after one warm-up pass over the queries,
+    // counts the allocations of a second pass through KD_Tree::kNN with a caller-owned context
+    // (exact and int8 storage) and KNN::classify (KD-tree, brute force and ball tree backends).
+    // Writes one CSV line per path and returns true if every count was 0. Needs the allocation
+    // hook installed, otherwise every count reads 0.
+    bool checkAllocations(std::ostream& out) const;
+
+    // Incremental build check for every case: inserts the points one at a time into an empty
+    // KD_Tree and compares its bucket size with KD_Tree::leafSizeFor for the same threshold and
+    // point count, and its leaf count with a tree built from the same points. Writes one CSV line
+    // per case and returns true if every bucket size matched and no tree had over 4x the leaves.
+    bool checkIncrementalBuild(std::ostream& out) const;
+
+    // Allocation hook, counted per phase; safe to call from any thread
+    static void countAllocation(size_t bytes);
+};
+
+#endif // KNN_BENCHMARK_H
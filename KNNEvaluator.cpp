@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include "KNNEvaluator.h"
+#include "KNNJoin.h"
+
+namespace {
+
+    double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Rows of columns listed in rows, as a dataset of their own
+    void selectRows(const ColumnarDataset& columns, const std::vector<uint32_t>& rows, ColumnarDataset& into) {
+        into.features.assign(columns.features.dimensions(), rows.size());
+        into.label_ids.resize(rows.size());
+        into.labels = columns.labels;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            for (size_t d = 0; d < columns.features.dimensions(); ++d) {
+                into.features.set(i, d, columns.features.at(rows[i], d));
+            }
+            into.label_ids[i] = columns.label_ids[rows[i]];
+        }
+    }
+}
+
+KNNEvaluator::KNNEvaluator(const std::vector<size_t>& kValues, const std::vector<double>& thresholdValues,
+                           size_t foldCount)
+        : k_values(kValues), thresholds(thresholdValues), folds(foldCount), seed(5489),
+          vote_rule(VOTE_MAJORITY), thread_count(0) {}
+
+ThreadPool& KNNEvaluator::threadPool() {
+    if (!pool) {
+        pool.reset(new ThreadPool(thread_count));
+    }
+    return *pool;
+}
+
+void KNNEvaluator::setFolds(size_t foldCount) {
+    folds = foldCount;
+}
+
+void KNNEvaluator::setSeed(uint32_t value) {
+    seed = value;
+}
+
+void KNNEvaluator::setVoteRule(VoteRule rule) {
+    vote_rule = rule;
+}
+
+void KNNEvaluator::setSearchOptions(const KDTreeSearchOptions& options) {
+    search_options = options;
+}
+
+void KNNEvaluator::setThreadCount(size_t threads) {
+    if (threads != thread_count) {
+        thread_count = threads;
+        pool.reset();
+    }
+}
+
+void KNNEvaluator::configure(KNN& model) const {
+    // Rows reported by the KD-tree are what the leave-one-out join votes over, and a fixed
+    // backend keeps every fold on the same search
+    model.setBackend(BACKEND_KD_TREE);
+    model.setVoteRule(vote_rule);
+    model.setSearchOptions(search_options);
+}
+
+std::vector<EvaluationScore> KNNEvaluator::evaluate(const Dataset& data) {
+    std::vector<EvaluationScore> scores;
+    if (data.points.empty() || k_values.empty() ||
+        std::find(k_values.begin(), k_values.end(), 0) != k_values.end()) {
+        std::cerr << "Cannot evaluate without points or with k = 0" << std::endl;
+        return scores;
+    }
+
+    // Columnar copy with interned labels, fold training sets are cut from it
+    ColumnarDataset columns;
+    columns.features.assign(data.points[0].features.size(), data.points.size());
+    columns.label_ids.resize(data.points.size());
+    for (size_t i = 0; i < data.points.size(); ++i) {
+        columns.features.setRow(i, data.points[i].features);
+        columns.label_ids[i] = columns.labels.intern(data.points[i].label);
+    }
+
+    bool leaveOneOut = folds == 0 || folds >= data.points.size();
+    scores.resize(thresholds.size() * k_values.size());
+    for (size_t t = 0; t < thresholds.size(); ++t) {
+        EvaluationScore* row = scores.data() + t * k_values.size();
+        for (size_t i = 0; i < k_values.size(); ++i) {
+            row[i] = EvaluationScore{thresholds[t], k_values[i], 0, 0, 0.0, 0.0, 0.0};
+        }
+        if (leaveOneOut) {
+            evaluateLeaveOneOut(columns, thresholds[t], row);
+        } else {
+            evaluateFolds(data, columns, thresholds[t], row);
+        }
+        for (size_t i = 0; i < k_values.size(); ++i) {
+            row[i].accuracy = row[i].total > 0 ? static_cast<double>(row[i].correct) / row[i].total : 0.0;
+        }
+    }
+    return scores;
+}
+
+void KNNEvaluator::evaluateFolds(const Dataset& data, const ColumnarDataset& columns, double threshold,
+                                 EvaluationScore* scores) {
+    size_t pointCount = data.points.size();
+    size_t maxK = *std::max_element(k_values.begin(), k_values.end());
+
+    // Same seeded shuffle for every threshold, so all settings are scored on the same folds
+    std::vector<uint32_t> order(pointCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+    std::vector<std::vector<uint32_t>> heldOut(folds);
+    for (size_t i = 0; i < pointCount; ++i) {
+        heldOut[i % folds].push_back(order[i]);
+    }
+
+    // Per fold tallies, added up once every fold is done
+    std::vector<std::vector<size_t>> correct(folds, std::vector<size_t>(k_values.size(), 0));
+    std::vector<double> trainSeconds(folds, 0.0);
+    std::vector<double> querySeconds(folds, 0.0);
+
+    threadPool().parallelFor(folds, 1, [&](size_t begin, size_t end, size_t) {
+        std::vector<Prediction> predictions(k_values.size());
+        std::vector<uint32_t> trainRows;
+        std::vector<char> isHeldOut(pointCount);
+
+        for (size_t fold = begin; fold < end; ++fold) {
+            std::fill(isHeldOut.begin(), isHeldOut.end(), 0);
+            for (uint32_t row : heldOut[fold]) {
+                isHeldOut[row] = 1;
+            }
+            trainRows.clear();
+            for (uint32_t row = 0; row < pointCount; ++row) {
+                if (!isHeldOut[row]) {
+                    trainRows.push_back(row);
+                }
+            }
+
+            // Folds already run in parallel, each model trains on its own thread
+            auto start = std::chrono::steady_clock::now();
+            ColumnarDataset training;
+            selectRows(columns, trainRows, training);
+            KNN model(static_cast<int>(maxK), threshold);
+            model.setThreadCount(1);
+            configure(model);
+            model.train(training);
+            trainSeconds[fold] = secondsSince(start);
+
+            start = std::chrono::steady_clock::now();
+            for (uint32_t row : heldOut[fold]) {
+                const Point& point = data.points[row];
+                uint32_t truth = model.getLabels().find(point.label);
+                model.classifyEachK(point, k_values, predictions.data());
+                for (size_t i = 0; i < k_values.size(); ++i) {
+                    correct[fold][i] += truth != LabelTable::NOT_FOUND && predictions[i].label_id == truth ? 1 : 0;
+                }
+            }
+            querySeconds[fold] = secondsSince(start);
+        }
+    });
+
+    for (size_t fold = 0; fold < folds; ++fold) {
+        for (size_t i = 0; i < k_values.size(); ++i) {
+            scores[i].correct += correct[fold][i];
+            scores[i].total += heldOut[fold].size();
+            scores[i].train_seconds += trainSeconds[fold];
+            scores[i].query_seconds += querySeconds[fold];
+        }
+    }
+}
+
+void KNNEvaluator::evaluateLeaveOneOut(const ColumnarDataset& columns, double threshold, EvaluationScore* scores) {
+    size_t maxK = *std::max_element(k_values.begin(), k_values.end());
+
+    auto start = std::chrono::steady_clock::now();
+    KNN model(static_cast<int>(maxK), threshold);
+    model.setThreadCount(thread_count);
+    configure(model);
+    model.train(columns);
+    double trainSeconds = secondsSince(start);
+
+    // Every row's neighbors among all other rows, in one traversal of the tree with itself
+    start = std::chrono::steady_clock::now();
+    KNNJoin join;
+    join.selfJoin(model.tree, maxK, &threadPool());
+
+    ThreadPool& workers = threadPool();
+    std::vector<std::vector<size_t>> correct(workers.size(), std::vector<size_t>(k_values.size(), 0));
+    workers.parallelFor(join.rows(), 256, [&](size_t begin, size_t end, size_t worker) {
+        std::vector<Prediction> predictions(k_values.size());
+        for (size_t row = begin; row < end; ++row) {
+            uint32_t truth = model.tree.getLabelId(static_cast<uint32_t>(row));
+            model.classifyEachK(join.candidates(static_cast<uint32_t>(row)), join.count(static_cast<uint32_t>(row)),
+                                k_values, predictions.data());
+            for (size_t i = 0; i < k_values.size(); ++i) {
+                correct[worker][i] += predictions[i].label_id == truth ? 1 : 0;
+            }
+        }
+    });
+    double querySeconds = secondsSince(start);
+
+    for (size_t i = 0; i < k_values.size(); ++i) {
+        for (const auto& tally : correct) {
+            scores[i].correct += tally[i];
+        }
+        scores[i].total = join.rows();
+        scores[i].train_seconds = trainSeconds;
+        scores[i].query_seconds = querySeconds;
+    }
+}
+
+EvaluationScore KNNEvaluator::best(const std::vector<EvaluationScore>& scores) {
+    EvaluationScore result = {0.0, 0, 0, 0, 0.0, 0.0, 0.0};
+    bool found = false;
+    for (const auto& score : scores) {
+        bool better = !found || score.accuracy > result.accuracy ||
+                      (score.accuracy == result.accuracy &&
+                       (score.k < result.k || (score.k == result.k && score.query_seconds < result.query_seconds)));
+        if (better) {
+            result = score;
+            found = true;
+        }
+    }
+    return result;
+}
+
+void KNNEvaluator::report(std::ostream& out, const std::vector<EvaluationScore>& scores) {
+    out << "threshold,k,correct,total,accuracy,train_ms,query_ms\n";
+    for (const auto& score : scores) {
+        out << score.threshold << ',' << score.k << ',' << score.correct << ',' << score.total << ','
+            << score.accuracy << ',' << score.train_seconds * 1000.0 << ',' << score.query_seconds * 1000.0 << '\n';
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef KNN_EVALUATOR_H
+#define KNN_EVALUATOR_H
+
+#include "kNN.h"
+#include "ThreadPool.h"
+#include "kNN_Data.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+// Accuracy of one (threshold, k) setting
+struct EvaluationScore {
+    double threshold;
+    size_t k;
+    size_t correct;
+    size_t total;
+    double accuracy;      // correct / total
+    double train_seconds; // building the models at this threshold, summed over folds
+    double query_seconds; // neighbor searches and votes at this threshold, summed over folds and shared by every k
+};
+
+// Cross-validation for picking KNN's k and split threshold. Every held-out point gets one
+// search for the largest candidate k, and every smaller k is scored from the front of that
+// same neighbor list, so adding candidate k values costs votes but no searches. Folds are
+// trained and scored in parallel on the evaluator's thread pool.
+//
+// With exact search the threshold only changes the tree shape, not the neighbors, so it
+// shows up in the timings; with approximate search options it can change accuracy too.
+//
+// Leave-one-out (folds = 0) trains one model on all points and finds every point's
+// neighbors among the others with one KNNJoin::selfJoin. The scaler is then fitted with
+// the held-out point included, and the join is always exact.
+class KNNEvaluator {
+private:
+    std::vector<size_t> k_values;
+    std::vector<double> thresholds;
+    size_t folds; // 0 for leave-one-out
+    uint32_t seed; // fold assignment shuffle
+    VoteRule vote_rule;
+    KDTreeSearchOptions search_options;
+    size_t thread_count; // 0 means one per hardware thread
+    std::unique_ptr<ThreadPool> pool;
+
+    ThreadPool& threadPool();
+
+    // Fills scores[i] for k_values[i] at one threshold
+    void evaluateFolds(const Dataset& data, const ColumnarDataset& columns, double threshold,
+                       EvaluationScore* scores);
+    void evaluateLeaveOneOut(const ColumnarDataset& columns, double threshold, EvaluationScore* scores);
+    void configure(KNN& model) const;
+
+public:
+    KNNEvaluator(const std::vector<size_t>& kValues, const std::vector<double>& thresholdValues,
+                 size_t foldCount = 10);
+
+    void setFolds(size_t foldCount); // 0, or at least the dataset size, for leave-one-out
+    void setSeed(uint32_t value);
+    void setVoteRule(VoteRule rule);
+    void setSearchOptions(const KDTreeSearchOptions& options);
+    void setThreadCount(size_t threads);
+
+    // Scores every (threshold, k) pair, ordered by threshold, then k as given
+    std::vector<EvaluationScore> evaluate(const Dataset& data);
+
+    // Highest accuracy, ties go to the smaller k, then the faster queries
+    static EvaluationScore best(const std::vector<EvaluationScore>& scores);
+
+    // Machine-readable results, one CSV line per score after a header line
+    static void report(std::ostream& out, const std::vector<EvaluationScore>& scores);
+};
+
+#endif // KNN_EVALUATOR_H
@@ -0,0 +1,76 @@
+#include <thread>
+#include "KNNHandle.h"
+
+size_t KNNHandle::readerShard() {
+    // Threads are spread over the shards round robin, so concurrent readers rarely share a counter
+    static std::atomic<size_t> nextShard(0);
+    static thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % reader_shards;
+    return shard;
+}
+
+KNNHandle::ReadGuard::ReadGuard(const KNNHandle& owner) : handle(&owner), model(nullptr), shard(readerShard()) {
+    // Register under the current phase; if a publisher flipped it in between, the registration
+    // may already have been counted as drained, so undo it and try again
+    std::atomic<size_t>* counters = owner.shards[shard].active;
+    for (;;) {
+        readPhase = owner.phase.load();
+        counters[readPhase].fetch_add(1);
+        if (owner.phase.load() == readPhase) {
+            break;
+        }
+        counters[readPhase].fetch_sub(1);
+    }
+    model = owner.current.load();
+}
+
+KNNHandle::ReadGuard::~ReadGuard() {
+    handle->shards[shard].active[readPhase].fetch_sub(1, std::memory_order_release);
+}
+
+KNNHandle::KNNHandle() : current(nullptr), phase(0) {
+    for (auto& shard : shards) {
+        shard.active[0].store(0);
+        shard.active[1].store(0);
+    }
+}
+
+KNNHandle::~KNNHandle() {
+    delete current.load();
+}
+
+void KNNHandle::publish(std::unique_ptr<KNN> model) {
+    if (model) {
+        model->prepare();
+    }
+
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    const KNN* previous = current.exchange(model.release());
+
+    // Readers registering from here on see the new phase and therefore the new snapshot
+    unsigned oldPhase = phase.load();
+    phase.store(1 - oldPhase);
+
+    // The drain loads must stay seq_cst: a reader increments its counter and then reloads phase
+    // while this stores phase and then loads the counter, and with weaker orderings both sides may
+    // miss each other's write, letting the old snapshot be freed under a registered reader
+    for (auto& shard : shards) {
+        while (shard.active[oldPhase].load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+    delete previous;
+}
+
+Prediction KNNHandle::classify(const Point& queryPoint) const {
+    ReadGuard snapshot(*this);
+    if (snapshot.get() == nullptr) {
+        Prediction none = {LabelTable::NOT_FOUND, 0.0};
+        return none;
+    }
+    return snapshot->classify(queryPoint);
+}
+
+int KNNHandle::predict(const Point& queryPoint) const {
+    ReadGuard snapshot(*this);
+    return snapshot.get() == nullptr ? 0 : snapshot->predict(queryPoint);
+}
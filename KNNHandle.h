@@ -0,0 +1,71 @@
+#ifndef KNN_HANDLE_H
+#define KNN_HANDLE_H
+
+#include "kNN.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+// RCU-style holder of the current KNN model. Any number of threads query the current
+// snapshot without locks while another thread trains a replacement and publishes it.
+//
+// Readers announce themselves in one of two reader counters (sharded across cache lines)
+// selected by the current phase, then load the snapshot pointer. publish() swaps the
+// pointer, flips the phase and waits until the counters of the old phase drain; after
+// that no reader can still hold the old snapshot and it is deleted. Readers never wait,
+// only the publishing thread does, for at most the queries already in flight.
+class KNNHandle {
+private:
+    static const size_t reader_shards = 16;
+
+    struct alignas(64) ReaderShard {
+        std::atomic<size_t> active[2]; // readers inside a snapshot, per phase
+    };
+
+    std::atomic<const KNN*> current;
+    std::atomic<unsigned> phase;
+    mutable ReaderShard shards[reader_shards];
+    std::mutex writer_mutex; // serializes publishers, readers never take it
+
+    static size_t readerShard();
+
+public:
+    // Pins the snapshot that was current when it was created until it goes out of scope,
+    // for several queries that must all see the same model
+    class ReadGuard {
+    private:
+        const KNNHandle* handle;
+        const KNN* model;
+        size_t shard;
+        unsigned readPhase;
+
+    public:
+        explicit ReadGuard(const KNNHandle& owner);
+        ~ReadGuard();
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+        const KNN* get() const { return model; } // nullptr before the first publish
+        const KNN* operator->() const { return model; }
+    };
+
+    KNNHandle();
+    ~KNNHandle();
+
+    KNNHandle(const KNNHandle&) = delete;
+    KNNHandle& operator=(const KNNHandle&) = delete;
+
+    // Makes model the snapshot new queries see and deletes the previous one once its last
+    // reader has left. The model is prepared first (see KNN::prepare) and must not be
+    // modified after it is published.
+    void publish(std::unique_ptr<KNN> model);
+
+    // Queries on the current snapshot; without a model classify reports LabelTable::NOT_FOUND and predict 0
+    Prediction classify(const Point& queryPoint) const;
+    int predict(const Point& queryPoint) const;
+};
+
+#endif // KNN_HANDLE_H
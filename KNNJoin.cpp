@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include "KNNJoin.h"
+#include "DistanceKernels.h"
+
+namespace {
+    const double infinity = std::numeric_limits<double>::infinity();
+
+    // Squared box diagonals: the reference side of a node pair is split while its box is more
+    // than 4 times as wide as the query box. Splitting both sides evenly visits far more node
+    // pairs than it saves distance computations with box bounds.
+    const double reference_split_ratio = 16.0;
+}
+
+void KNNJoin::NodeBoxes::compute(const KD_Tree& tree) {
+    dims = tree.getFeatures().dimensions();
+    // Unreachable nodes keep an empty box (lower > upper), which is infinitely far from everything
+    lower.assign(tree.getNodeCount() * dims, infinity);
+    upper.assign(tree.getNodeCount() * dims, -infinity);
+    extents.assign(tree.getNodeCount(), 0.0);
+    if (tree.getRoot() != nullptr) {
+        computeRecursive(tree, 0);
+    }
+}
+
+void KNNJoin::NodeBoxes::computeRecursive(const KD_Tree& tree, uint32_t nodeIndex) {
+    const KDTreeNode& node = tree.getNode(nodeIndex);
+    double* low = lower.data() + nodeIndex * dims;
+    double* high = upper.data() + nodeIndex * dims;
+
+    if (node.isLeaf()) {
+        const FeatureMatrix& features = tree.getFeatures();
+        for (size_t d = 0; d < dims; ++d) {
+            const double* column = features.column(d);
+            for (uint32_t row = node.begin(); row < node.end(); ++row) {
+                low[d] = std::min(low[d], column[row]);
+                high[d] = std::max(high[d], column[row]);
+            }
+        }
+        extents[nodeIndex] = diagonal(nodeIndex);
+        return;
+    }
+
+    // Children first, the parent's box is their union
+    computeRecursive(tree, node.left);
+    computeRecursive(tree, node.right);
+    for (size_t d = 0; d < dims; ++d) {
+        low[d] = std::min(lowerOf(node.left)[d], lowerOf(node.right)[d]);
+        high[d] = std::max(upperOf(node.left)[d], upperOf(node.right)[d]);
+    }
+    extents[nodeIndex] = diagonal(nodeIndex);
+}
+
+double KNNJoin::NodeBoxes::diagonal(uint32_t nodeIndex) const {
+    // Empty boxes (lower > upper) measure 0
+    double sum = 0.0;
+    for (size_t d = 0; d < dims; ++d) {
+        double width = std::max(0.0, upperOf(nodeIndex)[d] - lowerOf(nodeIndex)[d]);
+        sum += width * width;
+    }
+    return sum;
+}
+
+KNNJoin::KNNJoin() : queries(nullptr), references(nullptr), self_join(false), k(0), node_pairs(0),
+                     distances_computed(0) {
+}
+
+void KNNJoin::clear() {
+    queries = nullptr;
+    references = nullptr;
+    self_join = false;
+    k = 0;
+    query_boxes.clear();
+    reference_boxes.clear();
+    bounds.clear();
+    nearest.clear();
+    heaps.clear();
+    found.clear();
+    seeds.clear();
+    node_pairs = 0;
+    distances_computed = 0;
+}
+
+void KNNJoin::join(const KD_Tree& queryTree, const KD_Tree& referenceTree, size_t neighborCount, ThreadPool* pool) {
+    clear();
+    if (queryTree.getRoot() != nullptr && referenceTree.getRoot() != nullptr &&
+        queryTree.getFeatures().dimensions() != referenceTree.getFeatures().dimensions()) {
+        std::cerr << "Cannot join trees of different dimensions" << std::endl;
+        return;
+    }
+
+    queries = &queryTree;
+    references = &referenceTree;
+    k = neighborCount;
+    query_boxes.compute(queryTree);
+    reference_boxes.compute(referenceTree);
+    run(pool);
+}
+
+void KNNJoin::selfJoin(const KD_Tree& tree, size_t neighborCount, ThreadPool* pool) {
+    clear();
+    queries = &tree;
+    references = &tree;
+    self_join = true;
+    k = neighborCount;
+    // Both sides share the query boxes
+    query_boxes.compute(tree);
+    run(pool);
+}
+
+void KNNJoin::run(ThreadPool* pool) {
+    size_t rowCount = queries->getFeatures().size();
+    found.assign(rowCount, 0);
+    if (k == 0 || queries->getRoot() == nullptr || references->getRoot() == nullptr) {
+        queries = references = nullptr;
+        return;
+    }
+    heaps.resize(rowCount * k);
+    seeds.assign(queries->getNodeCount(), UINT32_MAX);
+    bounds.assign(queries->getNodeCount(), infinity);
+    nearest.assign(queries->getNodeCount(), infinity);
+    // Nodes without points want nothing, otherwise they would hold their parents' bounds at infinity
+    for (uint32_t nodeIndex = 0; nodeIndex < bounds.size(); ++nodeIndex) {
+        if (query_boxes.dims > 0 && query_boxes.lowerOf(nodeIndex)[0] > query_boxes.upperOf(nodeIndex)[0]) {
+            bounds[nodeIndex] = -infinity;
+        }
+    }
+
+    // Query subtrees only ever tighten their own bounds and fill their own rows' heaps, so
+    // disjoint subtrees can be joined with the whole reference tree independently
+    size_t workers = pool != nullptr ? pool->size() : 1;
+    std::vector<uint32_t> frontier(1, 0);
+    while (workers > 1 && frontier.size() < 4 * workers) {
+        std::vector<uint32_t> next;
+        for (uint32_t nodeIndex : frontier) {
+            const KDTreeNode& node = queries->getNode(nodeIndex);
+            if (node.isLeaf()) {
+                next.push_back(nodeIndex);
+            } else {
+                next.push_back(node.left);
+                next.push_back(node.right);
+            }
+        }
+        if (next.size() == frontier.size()) {
+            break;
+        }
+        frontier.swap(next);
+    }
+
+    const NodeBoxes& referenceBoxes = self_join ? query_boxes : reference_boxes;
+    std::vector<Traversal> states(workers);
+    auto body = [&](size_t begin, size_t end, size_t worker) {
+        Traversal& state = states[worker];
+        state.query.resize(queries->getFeatures().dimensions());
+        for (size_t i = begin; i < end; ++i) {
+            seedRecursive(frontier[i], state);
+            joinRecursive(frontier[i], 0, boxDistance(query_boxes, frontier[i], referenceBoxes, 0), state);
+        }
+    };
+    if (pool != nullptr) {
+        pool->parallelFor(frontier.size(), 1, body);
+    } else {
+        body(0, frontier.size(), 0);
+    }
+
+    for (const Traversal& state : states) {
+        node_pairs += state.node_pairs;
+        distances_computed += state.distances_computed;
+    }
+
+    // Turn every row's max-heap into ascending distance order
+    for (size_t row = 0; row < rowCount; ++row) {
+        std::sort_heap(heaps.begin() + row * k, heaps.begin() + row * k + found[row]);
+    }
+
+    // Only row indices of the trees are handed out from here on
+    queries = references = nullptr;
+}
+
+void KNNJoin::joinRecursive(uint32_t queryNode, uint32_t referenceNode, double distance, Traversal& state) {
+    ++state.node_pairs;
+
+    // No reference point below referenceNode can beat the worst k-th distance of the query node.
+    // Empty boxes are infinitely far away, so unreachable and emptied nodes end here too.
+    if (distance >= bounds[queryNode]) {
+        return;
+    }
+
+    const NodeBoxes& referenceBoxes = self_join ? query_boxes : reference_boxes;
+    const KDTreeNode& query = queries->getNode(queryNode);
+    const KDTreeNode& reference = references->getNode(referenceNode);
+
+    // Query leaves continue point by point, each against its own k-th distance
+    if (query.isLeaf()) {
+        for (uint32_t row = query.begin(); row < query.end(); ++row) {
+            loadQuery(row, state);
+            if (pointBoxDistance(state.query.data(), referenceBoxes, referenceNode) < kthDistance(row)) {
+                pointRecursive(row, referenceNode, seeds[queryNode], state);
+            }
+        }
+        updateBound(queryNode);
+        return;
+    }
+
+    // Split the reference side while its box is clearly the larger one, the nearer child first
+    // so its points tighten the bound before the other one is checked. Query nodes are split
+    // down to leaves sooner, since below a query leaf every row searches on its own bound.
+    if (!reference.isLeaf() &&
+        referenceBoxes.extents[referenceNode] > reference_split_ratio * query_boxes.extents[queryNode]) {
+        double leftDistance = boxDistance(query_boxes, queryNode, referenceBoxes, reference.left);
+        double rightDistance = boxDistance(query_boxes, queryNode, referenceBoxes, reference.right);
+        if (leftDistance <= rightDistance) {
+            joinRecursive(queryNode, reference.left, leftDistance, state);
+            joinRecursive(queryNode, reference.right, rightDistance, state);
+        } else {
+            joinRecursive(queryNode, reference.right, rightDistance, state);
+            joinRecursive(queryNode, reference.left, leftDistance, state);
+        }
+        return;
+    }
+
+    joinRecursive(query.left, referenceNode,
+                  boxDistance(query_boxes, query.left, referenceBoxes, referenceNode), state);
+    joinRecursive(query.right, referenceNode,
+                  boxDistance(query_boxes, query.right, referenceBoxes, referenceNode), state);
+    combineBounds(queryNode);
+}
+
+void KNNJoin::seedRecursive(uint32_t queryNode, Traversal& state) {
+    const KDTreeNode& query = queries->getNode(queryNode);
+    if (!query.isLeaf()) {
+        seedRecursive(query.left, state);
+        seedRecursive(query.right, state);
+        combineBounds(queryNode);
+        return;
+    }
+    if (query.begin() == query.end()) {
+        return;
+    }
+
+    // Seed the heaps from the reference leaf holding the leaf's center, so the traversal starts
+    // out with a tight bound instead of taking the first leaves it comes across
+    uint32_t referenceNode = 0;
+    while (!references->getNode(referenceNode).isLeaf()) {
+        const KDTreeNode& node = references->getNode(referenceNode);
+        double center = 0.5 * (query_boxes.lowerOf(queryNode)[node.split_dimension] +
+                               query_boxes.upperOf(queryNode)[node.split_dimension]);
+        referenceNode = center < node.split_value ? node.left : node.right;
+    }
+    seeds[queryNode] = referenceNode;
+
+    for (uint32_t row = query.begin(); row < query.end(); ++row) {
+        loadQuery(row, state);
+        scanRow(row, references->getNode(referenceNode), state);
+    }
+    updateBound(queryNode);
+}
+
+void KNNJoin::loadQuery(uint32_t row, Traversal& state) const {
+    const FeatureMatrix& queryFeatures = queries->getFeatures();
+    for (size_t d = 0; d < state.query.size(); ++d) {
+        state.query[d] = queryFeatures.at(row, d);
+    }
+}
+
+void KNNJoin::pointRecursive(uint32_t row, uint32_t referenceNode, uint32_t seed, Traversal& state) {
+    // Single-tree search below referenceNode, as in KD_Tree::kNNRecursive
+    const KDTreeNode& node = references->getNode(referenceNode);
+    if (node.isLeaf()) {
+        if (referenceNode != seed) {
+            scanRow(row, node, state);
+        }
+        return;
+    }
+    double diff = state.query[node.split_dimension] - node.split_value;
+    uint32_t nearChild = diff < 0 ? node.left : node.right;
+    uint32_t farChild = diff < 0 ? node.right : node.left;
+    pointRecursive(row, nearChild, seed, state);
+    if (diff * diff < kthDistance(row)) {
+        pointRecursive(row, farChild, seed, state);
+    }
+}
+
+void KNNJoin::scanRow(uint32_t row, const KDTreeNode& reference, Traversal& state) {
+    size_t count = reference.end() - reference.begin();
+    if (state.distances.size() < count) {
+        state.distances.resize(count);
+    }
+    DistanceKernels::squaredDistances(references->getFeatures(), reference.begin(), reference.end(),
+                                      state.query.data(), state.distances.data());
+    state.distances_computed += count;
+
+    // Bounded max-heap in the row's k slots, as in KDTreeQuery::offer
+    std::pair<double, uint32_t>* heap = heaps.data() + static_cast<size_t>(row) * k;
+    uint32_t& size = found[row];
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t referenceRow = reference.begin() + static_cast<uint32_t>(i);
+        if (self_join && referenceRow == row) {
+            continue;
+        }
+        if (size < k) {
+            heap[size++] = std::make_pair(state.distances[i], referenceRow);
+            std::push_heap(heap, heap + size);
+        } else if (state.distances[i] < heap[0].first) {
+            std::pop_heap(heap, heap + size);
+            heap[size - 1] = std::make_pair(state.distances[i], referenceRow);
+            std::push_heap(heap, heap + size);
+        }
+    }
+}
+
+void KNNJoin::updateBound(uint32_t queryNode) {
+    const KDTreeNode& leaf = queries->getNode(queryNode);
+    double worst = -infinity;
+    double best = infinity;
+    for (uint32_t row = leaf.begin(); row < leaf.end(); ++row) {
+        double kth = kthDistance(row);
+        worst = std::max(worst, kth);
+        best = std::min(best, kth);
+    }
+    setBound(queryNode, worst, best);
+}
+
+void KNNJoin::combineBounds(uint32_t queryNode) {
+    const KDTreeNode& node = queries->getNode(queryNode);
+    setBound(queryNode, std::max(bounds[node.left], bounds[node.right]),
+             std::min(nearest[node.left], nearest[node.right]));
+}
+
+void KNNJoin::setBound(uint32_t queryNode, double worst, double best) {
+    // Every row of the node is within the box diagonal of the row with the best k-th distance,
+    // so it has k neighbors within that distance plus the diagonal
+    double reach = std::sqrt(best) + std::sqrt(query_boxes.extents[queryNode]);
+    bounds[queryNode] = std::min(worst, reach * reach);
+    nearest[queryNode] = best;
+}
+
+double KNNJoin::kthDistance(uint32_t queryRow) const {
+    return found[queryRow] < k ? infinity : heaps[static_cast<size_t>(queryRow) * k].first;
+}
+
+double KNNJoin::boxDistance(const NodeBoxes& a, uint32_t nodeA, const NodeBoxes& b, uint32_t nodeB) {
+    const double* lowerA = a.lowerOf(nodeA);
+    const double* upperA = a.upperOf(nodeA);
+    const double* lowerB = b.lowerOf(nodeB);
+    const double* upperB = b.upperOf(nodeB);
+
+    // Squared gap between the boxes, per dimension 0 where their extents overlap
+    double sum = 0.0;
+    for (size_t d = 0; d < a.dims; ++d) {
+        double gap = std::max(0.0, std::max(lowerB[d] - upperA[d], lowerA[d] - upperB[d]));
+        sum += gap * gap;
+    }
+    return sum;
+}
+
+double KNNJoin::pointBoxDistance(const double* point, const NodeBoxes& boxes, uint32_t node) {
+    const double* lower = boxes.lowerOf(node);
+    const double* upper = boxes.upperOf(node);
+    double sum = 0.0;
+    for (size_t d = 0; d < boxes.dims; ++d) {
+        double gap = std::max(0.0, std::max(lower[d] - point[d], point[d] - upper[d]));
+        sum += gap * gap;
+    }
+    return sum;
+}
+
+size_t KNNJoin::neighbors(uint32_t queryRow, KDTreeNeighbor* out) const {
+    const std::pair<double, uint32_t>* row = candidates(queryRow);
+    for (size_t i = 0; i < found[queryRow]; ++i) {
+        out[i].index = row[i].second;
+        out[i].distance = std::sqrt(row[i].first);
+    }
+    return found[queryRow];
+}
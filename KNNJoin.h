@@ -0,0 +1,117 @@
+#ifndef KNN_JOIN_H
+#define KNN_JOIN_H
+
+#include "KD_Tree.h"
+#include "ThreadPool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// All-k-nearest-neighbors join: the k nearest reference rows of every row of a query tree.
+// Instead of one KD_Tree::kNN per query, both trees are traversed together (dual-tree
+// search): a pair of nodes is skipped as soon as the distance between their bounding
+// boxes exceeds the worst k-th distance still wanted by any query below the query node,
+// so nearby queries share the upper levels of the search. Below a query leaf every row
+// goes on with its own bound. Queries are answered in spatial order, which also keeps the
+// reference leaves they touch in cache. Results are exact.
+//
+// selfJoin answers the same question for every training row against its own tree,
+// leaving the row itself out, as needed for outlier scores and leave-one-out evaluation.
+class KNNJoin {
+private:
+    // Tight per-node bounding boxes of one tree, node i's corners start at i * dims
+    struct NodeBoxes {
+        size_t dims;
+        std::vector<double> lower;
+        std::vector<double> upper;
+        std::vector<double> extents; // squared diagonal of every box, decides which side of a pair to split
+
+        NodeBoxes() : dims(0) {}
+
+        void compute(const KD_Tree& tree);
+        void computeRecursive(const KD_Tree& tree, uint32_t nodeIndex);
+        double diagonal(uint32_t nodeIndex) const;
+        void clear() {
+            lower.clear();
+            upper.clear();
+            extents.clear();
+        }
+        const double* lowerOf(uint32_t nodeIndex) const { return lower.data() + nodeIndex * dims; }
+        const double* upperOf(uint32_t nodeIndex) const { return upper.data() + nodeIndex * dims; }
+    };
+
+    // Per-thread traversal state
+    struct Traversal {
+        std::vector<double> query;     // query row gathered from the column-major features
+        std::vector<double> distances; // squared distances of one reference leaf
+        size_t node_pairs;
+        size_t distances_computed;
+
+        Traversal() : node_pairs(0), distances_computed(0) {}
+    };
+
+    const KD_Tree* queries;
+    const KD_Tree* references;
+    bool self_join;
+    size_t k;
+    NodeBoxes query_boxes;
+    NodeBoxes reference_boxes;
+    // Per query node: squared distance beyond which no reference point can be among the k nearest
+    // of any of its rows, and the smallest k-th squared distance found for one of its rows so far
+    std::vector<double> bounds;
+    std::vector<double> nearest;
+    std::vector<std::pair<double, uint32_t>> heaps; // k slots per query row: max-heap of (squared distance, reference row)
+    std::vector<uint32_t> found; // neighbors held in each query row's slots
+    std::vector<uint32_t> seeds; // per query leaf: reference leaf scanned before the traversal
+    size_t node_pairs;
+    size_t distances_computed;
+
+    void run(ThreadPool* pool);
+    // distance is the squared box distance between the two nodes
+    void joinRecursive(uint32_t queryNode, uint32_t referenceNode, double distance, Traversal& state);
+    void seedRecursive(uint32_t queryNode, Traversal& state);
+    // Search of one query row (loaded into state.query) below referenceNode, skipping its seed leaf
+    void pointRecursive(uint32_t row, uint32_t referenceNode, uint32_t seed, Traversal& state);
+    void scanRow(uint32_t row, const KDTreeNode& reference, Traversal& state);
+    void loadQuery(uint32_t row, Traversal& state) const;
+    void updateBound(uint32_t queryNode);   // query leaves, from their rows' heaps
+    void combineBounds(uint32_t queryNode); // internal query nodes, from their children
+    void setBound(uint32_t queryNode, double worst, double best);
+    double kthDistance(uint32_t queryRow) const;
+
+    static double boxDistance(const NodeBoxes& a, uint32_t nodeA, const NodeBoxes& b, uint32_t nodeB);
+    static double pointBoxDistance(const double* point, const NodeBoxes& boxes, uint32_t node);
+
+public:
+    KNNJoin();
+
+    // k nearest rows of referenceTree for every row of queryTree. With a pool, independent
+    // query subtrees are joined in parallel. Results refer to rows of both trees, which
+    // stay valid until their next build, insert or remove.
+    void join(const KD_Tree& queryTree, const KD_Tree& referenceTree, size_t k, ThreadPool* pool = nullptr);
+
+    // k nearest other rows of every row of tree (a row never lists itself; equal points in
+    // other rows are still neighbors at distance 0)
+    void selfJoin(const KD_Tree& tree, size_t k, ThreadPool* pool = nullptr);
+
+    void clear();
+
+    // Rows of the query tree the result covers (all rows, rows no leaf references have no neighbors)
+    size_t rows() const { return found.size(); }
+
+    // Writes the neighbors of queryRow to out[0 ..], nearest first, and returns how many were
+    // written (fewer than k only if the reference tree holds fewer points)
+    size_t neighbors(uint32_t queryRow, KDTreeNeighbor* out) const;
+
+    // Same neighbors as (squared distance, reference row) pairs, nearest first, like KDTreeQuery::heap
+    const std::pair<double, uint32_t>* candidates(uint32_t queryRow) const { return heaps.data() + queryRow * k; }
+    size_t count(uint32_t queryRow) const { return found[queryRow]; }
+
+    // Work done by the last join, for comparing against one search per query
+    size_t nodePairsVisited() const { return node_pairs; }
+    size_t distancesComputed() const { return distances_computed; }
+};
+
+#endif // KNN_JOIN_H
@@ -0,0 +1,48 @@
+#ifndef LABEL_TABLE_H
+#define LABEL_TABLE_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Interned class labels: every distinct label string gets a dense id 0, 1, 2, ... in order of
+// first appearance, so points only carry a uint32_t and voting works on integer histograms.
+class LabelTable {
+private:
+    std::vector<std::string> names;                   // label id -> label
+    std::unordered_map<std::string, uint32_t> lookup; // label -> label id
+
+public:
+    static const uint32_t NOT_FOUND = UINT32_MAX;
+
+    // Id of label, adding it to the table on first use
+    uint32_t intern(const std::string& label) {
+        auto found = lookup.find(label);
+        if (found != lookup.end()) {
+            return found->second;
+        }
+        uint32_t id = static_cast<uint32_t>(names.size());
+        names.push_back(label);
+        lookup.emplace(label, id);
+        return id;
+    }
+
+    // Id of label, NOT_FOUND if it was never interned
+    uint32_t find(const std::string& label) const {
+        auto found = lookup.find(label);
+        return found != lookup.end() ? found->second : NOT_FOUND;
+    }
+
+    const std::string& name(uint32_t id) const { return names[id]; }
+    const std::vector<std::string>& getNames() const { return names; }
+    size_t size() const { return names.size(); }
+    bool empty() const { return names.empty(); }
+
+    void clear() {
+        names.clear();
+        lookup.clear();
+    }
+};
+
+#endif // LABEL_TABLE_H
@@ -0,0 +1,115 @@
+#ifndef MAPPED_ARRAY_H
+#define MAPPED_ARRAY_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Array that either owns its elements in a std::vector or reads them from
+// external memory (for example a memory-mapped model file) without copying.
+// Const access always goes through the view. Non-const element access is only
+// valid on owned data, call detach() first; the resizing members detach on their own.
+template <typename T>
+class MappedArray {
+private:
+    std::vector<T> owned;
+    const T* view;  // owned.data() or the attached external memory
+    size_t count;
+    bool external;
+
+    void sync() {
+        view = owned.data();
+        count = owned.size();
+        external = false;
+    }
+
+public:
+    MappedArray() : view(nullptr), count(0), external(false) {}
+
+    MappedArray(const MappedArray& other) : owned(other.owned), view(nullptr), count(0), external(false) {
+        if (other.external) {
+            attach(other.view, other.count);
+        } else {
+            sync();
+        }
+    }
+
+    MappedArray(MappedArray&& other) noexcept : MappedArray() {
+        swap(other);
+    }
+
+    MappedArray& operator=(MappedArray other) {
+        swap(other);
+        return *this;
+    }
+
+    void swap(MappedArray& other) noexcept {
+        owned.swap(other.owned);
+        std::swap(view, other.view);
+        std::swap(count, other.count);
+        std::swap(external, other.external);
+    }
+
+    // Reads count elements from memory that must outlive this array (or the next detach)
+    void attach(const T* data, size_t elementCount) {
+        std::vector<T>().swap(owned);
+        view = data;
+        count = elementCount;
+        external = true;
+    }
+
+    // Copies attached elements into owned storage so they can be modified
+    void detach() {
+        if (external) {
+            owned.assign(view, view + count);
+            sync();
+        }
+    }
+
+    // Takes over the contents of values as owned storage
+    void adopt(std::vector<T>& values) {
+        owned.swap(values);
+        sync();
+    }
+
+    bool isAttached() const { return external; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* data() const { return view; }
+    const T* begin() const { return view; }
+    const T* end() const { return view + count; }
+
+    const T& operator[](size_t i) const { return view[i]; }
+    T& operator[](size_t i) { return owned[i]; }
+
+    void resize(size_t n) {
+        detach();
+        owned.resize(n);
+        sync();
+    }
+
+    void resize(size_t n, const T& value) {
+        detach();
+        owned.resize(n, value);
+        sync();
+    }
+
+    void assign(size_t n, const T& value) {
+        std::vector<T>().swap(owned);
+        owned.assign(n, value);
+        sync();
+    }
+
+    void push_back(const T& value) {
+        detach();
+        owned.push_back(value);
+        sync();
+    }
+
+    void clear() {
+        std::vector<T>().swap(owned);
+        sync();
+    }
+};
+
+#endif // MAPPED_ARRAY_H
@@ -0,0 +1,93 @@
+#include "ModelFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile() : address(nullptr), length(0) {
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string& filename) {
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Unable to open file: " << filename << std::endl;
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        std::cerr << "Unable to read file size: " << filename << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    // MAP_SHARED + PROT_READ: every process mapping the same model shares the page cache copy
+    void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Unable to map file: " << filename << std::endl;
+        return false;
+    }
+
+    address = static_cast<const char*>(mapped);
+    length = static_cast<size_t>(info.st_size);
+    return true;
+}
+
+void MappedFile::close() {
+    if (address != nullptr) {
+        munmap(const_cast<char*>(address), length);
+        address = nullptr;
+        length = 0;
+    }
+}
+
+const void* MappedFile::section(const ModelSection& section, size_t alignment) const {
+    if (section.offset > length || section.bytes > length - section.offset) {
+        return nullptr;
+    }
+    if (alignment > 1 && section.offset % alignment != 0) {
+        return nullptr;
+    }
+    return address + section.offset;
+}
+
+void MappedFile::adviseRandomAccess() const {
+    if (address != nullptr) {
+        madvise(const_cast<char*>(address), length, MADV_RANDOM);
+    }
+}
+
+void MappedFile::adviseRandomAccess(const ModelSection& section) const {
+    if (address == nullptr || section.bytes == 0 || this->section(section, 1) == nullptr) {
+        return;
+    }
+    // madvise wants a page-aligned start, the mapping itself is
+    uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint64_t begin = section.offset / page * page;
+    madvise(const_cast<char*>(address) + begin, section.offset + section.bytes - begin, MADV_RANDOM);
+}
+
+void ModelFileWriter::writeSection(std::ostream& out, const void* data, size_t bytes, ModelSection& section) {
+    static const char padding[MODEL_FILE_ALIGNMENT] = {};
+
+    uint64_t position = static_cast<uint64_t>(out.tellp());
+    uint64_t misalignment = position % MODEL_FILE_ALIGNMENT;
+    if (misalignment != 0) {
+        out.write(padding, static_cast<std::streamsize>(MODEL_FILE_ALIGNMENT - misalignment));
+        position += MODEL_FILE_ALIGNMENT - misalignment;
+    }
+
+    section.offset = position;
+    section.bytes = bytes;
+    if (bytes > 0) {
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+    }
+}
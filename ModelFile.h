@@ -0,0 +1,102 @@
+#ifndef MODEL_FILE_H
+#define MODEL_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// On-disk layout of a trained KNN model (KNN::save / KNN::load).
+//
+// The file starts with this header, followed by sections that each begin on a
+// MODEL_FILE_ALIGNMENT boundary so a read-only mapping of the file can be used
+// in place: the tree nodes, subtree sizes, feature columns and label ids are
+// read straight out of the mapped pages and shared between processes. A model
+// with compressed leaf scans (see QuantizedFeatures) also stores its code
+// columns, so a loaded model scans those and only pages in the exact columns
+// for the rows it re-ranks.
+// All values are stored in the writer's native byte order, endian_tag guards against
+// loading a file written on a machine with a different one.
+const char MODEL_FILE_MAGIC[8] = {'K', 'N', 'N', 'M', 'O', 'D', 'E', 'L'};
+const uint32_t MODEL_FILE_VERSION = 2; // 2 added the compressed leaf-scan sections
+const uint32_t MODEL_FILE_ENDIAN_TAG = 0x01020304;
+const uint64_t MODEL_FILE_ALIGNMENT = 64;
+
+// Offset and length in bytes of one section, offsets are from the start of the file
+struct ModelSection {
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+struct ModelFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_tag;
+    uint64_t file_size;
+
+    // KNN parameters
+    int64_t k;
+    double split_threshold;
+
+    // KD_Tree shape
+    uint64_t dimensions;
+    uint64_t rows;          // rows in the feature columns, including ones no leaf references
+    uint64_t node_count;
+    uint64_t leaf_size;
+    uint64_t dead_rows;
+    uint64_t dead_nodes;
+    uint64_t label_count;
+
+    // Leaf scan storage, a FeatureStorage; STORAGE_FLOAT64 leaves the quantized sections empty
+    uint32_t feature_storage;
+    uint32_t rerank_factor;
+
+    ModelSection feature_means;   // double[dimensions]
+    ModelSection feature_scales;  // double[dimensions]
+    ModelSection nodes;           // KDTreeNode[node_count]
+    ModelSection subtree_sizes;   // uint32_t[node_count]
+    ModelSection features;        // dimensions columns of rows doubles each
+    ModelSection label_ids;       // uint32_t[rows]
+    ModelSection label_names;     // label_count entries of (uint32_t length, chars)
+    ModelSection quantized_offsets; // double[dimensions], grid of the int16/int8 codes
+    ModelSection quantized_scales;  // double[dimensions]
+    ModelSection quantized;         // dimensions columns of rows codes each, padded like features
+};
+
+// Read-only, shared memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& filename);
+    void close();
+
+    const char* data() const { return address; }
+    size_t size() const { return length; }
+
+    // Pointer to a section after checking it lies inside the file and is suitably aligned, nullptr otherwise
+    const void* section(const ModelSection& section, size_t alignment) const;
+
+    // Tells the kernel pages will be touched in no particular order, so a fault reads in
+    // only the page it needs instead of a readahead window
+    void adviseRandomAccess() const;
+    // Same for the pages of one section only
+    void adviseRandomAccess(const ModelSection& section) const;
+
+private:
+    const char* address;
+    size_t length;
+};
+
+// Helpers for writing sections
+class ModelFileWriter {
+public:
+    // Pads out to the next MODEL_FILE_ALIGNMENT boundary, writes bytes and records where they went
+    static void writeSection(std::ostream& out, const void* data, size_t bytes, ModelSection& section);
+};
+
+#endif // MODEL_FILE_H
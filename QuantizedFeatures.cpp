@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cmath>
+#include "QuantizedFeatures.h"
+
+QuantizedFeatures::QuantizedFeatures() : storage(STORAGE_FLOAT64), rows(0) {
+}
+
+int32_t QuantizedFeatures::maxCode() const {
+    return storage == STORAGE_INT8 ? 127 : 32767;
+}
+
+size_t QuantizedFeatures::bytesPerValue() const {
+    switch (storage) {
+        case STORAGE_FLOAT32:
+            return sizeof(float);
+        case STORAGE_INT16:
+            return sizeof(int16_t);
+        case STORAGE_INT8:
+            return sizeof(int8_t);
+        default:
+            return sizeof(double);
+    }
+}
+
+size_t QuantizedFeatures::bytesPerRow() const {
+    return offsets.size() * bytesPerValue();
+}
+
+const void* QuantizedFeatures::column(size_t d) const {
+    switch (storage) {
+        case STORAGE_FLOAT32:
+            return float_columns[d].data();
+        case STORAGE_INT16:
+            return int16_columns[d].data();
+        default:
+            return int8_columns[d].data();
+    }
+}
+
+void QuantizedFeatures::clear() {
+    storage = STORAGE_FLOAT64;
+    rows = 0;
+    float_columns.clear();
+    int16_columns.clear();
+    int8_columns.clear();
+    offsets.clear();
+    scales.clear();
+}
+
+void QuantizedFeatures::encode(const FeatureMatrix& exact, FeatureStorage newStorage) {
+    clear();
+    storage = newStorage;
+    if (!enabled()) {
+        return;
+    }
+
+    size_t dims = exact.dimensions();
+    offsets.assign(dims, 0.0);
+    scales.assign(dims, 1.0);
+
+    // Quantization grid per dimension: centred on the value range, maxCode() steps to either side
+    if (storage != STORAGE_FLOAT32) {
+        for (size_t d = 0; d < dims; ++d) {
+            const double* column = exact.column(d);
+            double low = exact.size() > 0 ? column[0] : 0.0;
+            double high = low;
+            for (size_t i = 1; i < exact.size(); ++i) {
+                low = std::min(low, column[i]);
+                high = std::max(high, column[i]);
+            }
+            offsets[d] = (low + high) / 2;
+            scales[d] = high > low ? (high - low) / (2.0 * maxCode()) : 1.0;
+        }
+    }
+
+    float_columns.resize(storage == STORAGE_FLOAT32 ? dims : 0);
+    int16_columns.resize(storage == STORAGE_INT16 ? dims : 0);
+    int8_columns.resize(storage == STORAGE_INT8 ? dims : 0);
+    resize(exact.size());
+    for (size_t i = 0; i < exact.size(); ++i) {
+        encodeRow(i, exact, i);
+    }
+}
+
+void QuantizedFeatures::resize(size_t rowCount) {
+    rows = rowCount;
+    for (auto& column : float_columns) {
+        column.resize(rowCount);
+    }
+    for (auto& column : int16_columns) {
+        column.resize(rowCount);
+    }
+    for (auto& column : int8_columns) {
+        column.resize(rowCount);
+    }
+}
+
+void QuantizedFeatures::encodeRow(size_t row, const FeatureMatrix& exact, size_t exactRow) {
+    for (size_t d = 0; d < offsets.size(); ++d) {
+        double value = exact.at(exactRow, d);
+        if (storage == STORAGE_FLOAT32) {
+            float_columns[d][row] = static_cast<float>(value);
+            continue;
+        }
+
+        long code = std::lround((value - offsets[d]) / scales[d]);
+        code = std::max<long>(-maxCode(), std::min<long>(maxCode(), code));
+        if (storage == STORAGE_INT16) {
+            int16_columns[d][row] = static_cast<int16_t>(code);
+        } else {
+            int8_columns[d][row] = static_cast<int8_t>(code);
+        }
+    }
+}
+
+void QuantizedFeatures::squaredDistances(size_t begin, size_t end, const double* query, double* out) const {
+    size_t count = end - begin;
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = 0.0;
+    }
+
+    // Column at a time like the exact kernels; the integer paths work in code units and scale once per dimension
+    for (size_t d = 0; d < offsets.size(); ++d) {
+        if (storage == STORAGE_FLOAT32) {
+            const float* column = float_columns[d].data() + begin;
+            const float q = static_cast<float>(query[d]);
+            for (size_t i = 0; i < count; ++i) {
+                float diff = column[i] - q;
+                out[i] += diff * diff;
+            }
+            continue;
+        }
+
+        const float q = static_cast<float>((query[d] - offsets[d]) / scales[d]);
+        const double weight = scales[d] * scales[d];
+        if (storage == STORAGE_INT16) {
+            const int16_t* column = int16_columns[d].data() + begin;
+            for (size_t i = 0; i < count; ++i) {
+                float diff = static_cast<float>(column[i]) - q;
+                out[i] += weight * (diff * diff);
+            }
+        } else {
+            const int8_t* column = int8_columns[d].data() + begin;
+            for (size_t i = 0; i < count; ++i) {
+                float diff = static_cast<float>(column[i]) - q;
+                out[i] += weight * (diff * diff);
+            }
+        }
+    }
+}
+
+void QuantizedFeatures::writeSections(std::ostream& out, ModelFileHeader& header) const {
+    header.feature_storage = storage;
+    if (!enabled()) {
+        return;
+    }
+
+    ModelFileWriter::writeSection(out, offsets.data(), offsets.size() * sizeof(double), header.quantized_offsets);
+    ModelFileWriter::writeSection(out, scales.data(), scales.size() * sizeof(double), header.quantized_scales);
+
+    // Padded per column like the exact feature columns, see KD_Tree::writeSections
+    ModelSection section = {static_cast<uint64_t>(out.tellp()), 0};
+    header.quantized = section;
+    for (size_t d = 0; d < offsets.size(); ++d) {
+        ModelFileWriter::writeSection(out, column(d), rows * bytesPerValue(), section);
+        if (d == 0) {
+            header.quantized.offset = section.offset;
+        }
+    }
+    header.quantized.bytes = static_cast<uint64_t>(out.tellp()) - header.quantized.offset;
+}
+
+bool QuantizedFeatures::attach(const MappedFile& file, const ModelFileHeader& header) {
+    clear();
+    if (header.feature_storage > STORAGE_INT8) {
+        return false;
+    }
+    storage = static_cast<FeatureStorage>(header.feature_storage);
+    if (!enabled()) {
+        return true;
+    }
+
+    size_t dims = header.dimensions;
+    uint64_t columnBytes = header.rows * bytesPerValue();
+    uint64_t columnStride = (columnBytes + MODEL_FILE_ALIGNMENT - 1) / MODEL_FILE_ALIGNMENT * MODEL_FILE_ALIGNMENT;
+    const double* offsetData = static_cast<const double*>(file.section(header.quantized_offsets, alignof(double)));
+    const double* scaleData = static_cast<const double*>(file.section(header.quantized_scales, alignof(double)));
+    const char* codeData = static_cast<const char*>(file.section(header.quantized, MODEL_FILE_ALIGNMENT));
+    if (!offsetData || !scaleData || !codeData ||
+        header.quantized_offsets.bytes != dims * sizeof(double) ||
+        header.quantized_scales.bytes != dims * sizeof(double) ||
+        (dims > 0 && header.quantized.bytes != (dims - 1) * columnStride + columnBytes)) {
+        clear();
+        return false;
+    }
+
+    // The grid is a few doubles and gets copied, the code columns are read from the mapping
+    offsets.assign(offsetData, offsetData + dims);
+    scales.assign(scaleData, scaleData + dims);
+    float_columns.resize(storage == STORAGE_FLOAT32 ? dims : 0);
+    int16_columns.resize(storage == STORAGE_INT16 ? dims : 0);
+    int8_columns.resize(storage == STORAGE_INT8 ? dims : 0);
+    for (size_t d = 0; d < dims; ++d) {
+        const char* data = codeData + d * columnStride;
+        if (storage == STORAGE_FLOAT32) {
+            float_columns[d].attach(reinterpret_cast<const float*>(data), header.rows);
+        } else if (storage == STORAGE_INT16) {
+            int16_columns[d].attach(reinterpret_cast<const int16_t*>(data), header.rows);
+        } else {
+            int8_columns[d].attach(reinterpret_cast<const int8_t*>(data), header.rows);
+        }
+    }
+    rows = header.rows;
+    return true;
+}
+
+void QuantizedFeatures::detach() {
+    for (auto& column : float_columns) {
+        column.detach();
+    }
+    for (auto& column : int16_columns) {
+        column.detach();
+    }
+    for (auto& column : int8_columns) {
+        column.detach();
+    }
+}
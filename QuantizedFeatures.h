@@ -0,0 +1,68 @@
+#ifndef QUANTIZED_FEATURES_H
+#define QUANTIZED_FEATURES_H
+
+#include "FeatureMatrix.h"
+#include "MappedArray.h"
+#include "ModelFile.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Storage used for the leaf scans of a kNN search
+enum FeatureStorage {
+    STORAGE_FLOAT64, // scan the exact double columns (no compressed copy)
+    STORAGE_FLOAT32, // half the bytes per feature
+    STORAGE_INT16,   // per-dimension scalar quantization to 16 bit codes
+    STORAGE_INT8     // per-dimension scalar quantization to 8 bit codes
+};
+
+// Compressed copy of a FeatureMatrix, row for row, used to find kNN candidates
+// with less memory traffic. Every dimension d is quantized linearly over the
+// value range [min_d, max_d] seen when it was encoded; later rows outside that
+// range are clamped. Distances from here are approximate, callers re-rank the
+// candidates they keep against the exact matrix. Like the exact columns, the
+// codes can be written to a model file and read back from its mapping in place.
+class QuantizedFeatures {
+private:
+    FeatureStorage storage;
+    size_t rows;
+    std::vector<MappedArray<float>> float_columns;
+    std::vector<MappedArray<int16_t>> int16_columns;
+    std::vector<MappedArray<int8_t>> int8_columns;
+    std::vector<double> offsets; // value = offset + scale * code
+    std::vector<double> scales;
+
+    int32_t maxCode() const;
+    size_t bytesPerValue() const;
+    const void* column(size_t d) const;
+
+public:
+    QuantizedFeatures();
+
+    // Encodes every row of exact with the given storage, STORAGE_FLOAT64 drops the compressed copy
+    void encode(const FeatureMatrix& exact, FeatureStorage storage);
+    void clear();
+
+    FeatureStorage getStorage() const { return storage; }
+    bool enabled() const { return storage != STORAGE_FLOAT64; }
+    size_t size() const { return rows; }
+    size_t bytesPerRow() const;
+
+    // Keeps the copy in step with the exact matrix after rows were appended or rewritten
+    void resize(size_t rowCount);
+    void encodeRow(size_t row, const FeatureMatrix& exact, size_t exactRow);
+
+    // Model file support: writes the storage, grid and code columns and records them in header,
+    // or reads them from the sections of a mapped file (false if they do not match its shape).
+    // Attached codes must be detached before the copy is modified.
+    void writeSections(std::ostream& out, ModelFileHeader& header) const;
+    bool attach(const MappedFile& file, const ModelFileHeader& header);
+    void detach();
+
+    // Approximate squared distance from query to every row in [begin, end), written to out[0 .. end - begin)
+    void squaredDistances(size_t begin, size_t end, const double* query, double* out) const;
+};
+
+#endif // QUANTIZED_FEATURES_H
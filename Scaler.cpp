@@ -0,0 +1,136 @@
+#include <cmath>
+#include "Scaler.h"
+
+namespace {
+
+    const size_t rows_per_chunk = 4096;
+
+    // Running count, mean and sum of squared deviations of every feature (Welford)
+    struct Moments {
+        size_t count = 0;
+        std::vector<double> mean;
+        std::vector<double> m2;
+
+        explicit Moments(size_t dims = 0) : mean(dims, 0.0), m2(dims, 0.0) {}
+
+        // Folds in other, both summarizing disjoint sets of rows (Chan et al.)
+        void merge(const Moments& other) {
+            if (other.count == 0) {
+                return;
+            }
+            double total = static_cast<double>(count + other.count);
+            double weight = static_cast<double>(count) * other.count / total;
+            for (size_t d = 0; d < mean.size(); ++d) {
+                double delta = other.mean[d] - mean[d];
+                mean[d] += delta * other.count / total;
+                m2[d] += other.m2[d] + delta * delta * weight;
+            }
+            count += other.count;
+        }
+    };
+
+    // Gathers the per-worker moments into means/scales
+    void finish(std::vector<Moments>& partial, std::vector<double>& means, std::vector<double>& scales) {
+        for (size_t i = 1; i < partial.size(); ++i) {
+            partial[0].merge(partial[i]);
+        }
+        const Moments& all = partial[0];
+
+        means = all.mean;
+        scales.assign(means.size(), 1.0);
+        for (size_t d = 0; d < means.size() && all.count > 0; ++d) {
+            double deviation = std::sqrt(all.m2[d] / all.count);
+            if (deviation > 0.0) {
+                scales[d] = deviation;
+            }
+        }
+    }
+}
+
+void Scaler::fit(const std::vector<Point>& points, ThreadPool& pool) {
+    size_t dims = points.empty() ? 0 : points[0].features.size();
+    std::vector<Moments> partial(pool.size(), Moments(dims));
+
+    // Rows are contiguous here, so each worker walks its rows and updates every feature
+    pool.parallelFor(points.size(), rows_per_chunk, [&](size_t begin, size_t end, size_t worker) {
+        Moments& moments = partial[worker];
+        for (size_t i = begin; i < end; ++i) {
+            const double* row = points[i].features.data();
+            ++moments.count;
+            for (size_t d = 0; d < dims; ++d) {
+                double delta = row[d] - moments.mean[d];
+                moments.mean[d] += delta / moments.count;
+                moments.m2[d] += delta * (row[d] - moments.mean[d]);
+            }
+        }
+    });
+
+    finish(partial, means, scales);
+}
+
+void Scaler::fit(const FeatureMatrix& features, ThreadPool& pool) {
+    size_t dims = features.dimensions();
+    std::vector<Moments> partial(pool.size(), Moments(dims));
+
+    // A chunk of one column is contiguous, so each chunk is summarized column by column and then merged
+    pool.parallelFor(features.size(), rows_per_chunk, [&](size_t begin, size_t end, size_t worker) {
+        Moments chunk(dims);
+        chunk.count = end - begin;
+        for (size_t d = 0; d < dims; ++d) {
+            const double* column = features.column(d);
+            double mean = 0.0;
+            double m2 = 0.0;
+            for (size_t i = begin; i < end; ++i) {
+                double delta = column[i] - mean;
+                mean += delta / (i - begin + 1);
+                m2 += delta * (column[i] - mean);
+            }
+            chunk.mean[d] = mean;
+            chunk.m2[d] = m2;
+        }
+        partial[worker].merge(chunk);
+    });
+
+    finish(partial, means, scales);
+}
+
+void Scaler::assign(const double* meanValues, const double* scaleValues, size_t dimensions) {
+    means.assign(meanValues, meanValues + dimensions);
+    scales.assign(scaleValues, scaleValues + dimensions);
+}
+
+void Scaler::clear() {
+    means.clear();
+    scales.clear();
+}
+
+void Scaler::transform(const double* in, double* out) const {
+    for (size_t d = 0; d < means.size(); ++d) {
+        out[d] = (in[d] - means[d]) / scales[d];
+    }
+}
+
+void Scaler::transform(const std::vector<Point>& points, FeatureMatrix& out, ThreadPool& pool) const {
+    size_t dims = means.size();
+    out.assign(dims, points.size());
+    pool.parallelFor(points.size(), rows_per_chunk, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t d = 0; d < dims; ++d) {
+                out.set(i, d, (points[i].features[d] - means[d]) / scales[d]);
+            }
+        }
+    });
+}
+
+void Scaler::transform(const FeatureMatrix& in, FeatureMatrix& out, ThreadPool& pool) const {
+    size_t dims = means.size();
+    out.assign(dims, in.size());
+    pool.parallelFor(in.size(), rows_per_chunk, [&](size_t begin, size_t end, size_t) {
+        for (size_t d = 0; d < dims; ++d) {
+            const double* column = in.column(d);
+            for (size_t i = begin; i < end; ++i) {
+                out.set(i, d, (column[i] - means[d]) / scales[d]);
+            }
+        }
+    });
+}
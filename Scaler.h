@@ -0,0 +1,41 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+#include "FeatureMatrix.h"
+#include "ThreadPool.h"
+#include "kNN_Data.h"
+
+#include <cstddef>
+#include <vector>
+
+// Per-feature standardization x' = (x - mean) / scale, fitted on the training data and
+// applied unchanged to every query. A feature with zero variance gets scale 1, so it
+// maps to 0 instead of dividing by zero.
+class Scaler {
+private:
+    std::vector<double> means;
+    std::vector<double> scales; // population standard deviation, 1 for constant features
+
+public:
+    // One Welford pass over all features, split across the pool's workers and merged pairwise
+    void fit(const std::vector<Point>& points, ThreadPool& pool);
+    void fit(const FeatureMatrix& features, ThreadPool& pool);
+
+    // Restores parameters from a saved model
+    void assign(const double* meanValues, const double* scaleValues, size_t dimensions);
+    void clear();
+
+    bool fitted() const { return !means.empty(); }
+    size_t dimensions() const { return means.size(); }
+    const std::vector<double>& getMeans() const { return means; }
+    const std::vector<double>& getScales() const { return scales; }
+
+    // Scales one row of dimensions() features, in and out may be the same buffer
+    void transform(const double* in, double* out) const;
+
+    // Scaled copies of whole datasets, rows are spread over the pool
+    void transform(const std::vector<Point>& points, FeatureMatrix& out, ThreadPool& pool) const;
+    void transform(const FeatureMatrix& in, FeatureMatrix& out, ThreadPool& pool) const;
+};
+
+#endif // SCALER_H
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <vector>
+#include "SearchStats.h"
+
+namespace {
+
+    // Counter written by its owning thread only, so an increment is a plain load and store;
+    // the atomic just lets collect() read it from another thread
+    struct Counter {
+        std::atomic<uint64_t> value;
+
+        Counter() : value(0) {}
+
+        void add(uint64_t amount) {
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+        uint64_t get() const { return value.load(std::memory_order_relaxed); }
+        void clear() { value.store(0, std::memory_order_relaxed); }
+    };
+
+    struct ThreadBlock {
+        Counter queries;
+        Counter nodes_visited;
+        Counter leaves_visited;
+        Counter distances_computed;
+        Counter backtracks;
+        Counter pruned;
+        Counter latency_ns[StatsHistogram::BUCKETS];
+        Counter nodes[StatsHistogram::BUCKETS];
+        Counter backtrack_counts[StatsHistogram::BUCKETS];
+
+        void addTo(SearchStatsSnapshot& totals) const {
+            totals.queries += queries.get();
+            totals.nodes_visited += nodes_visited.get();
+            totals.leaves_visited += leaves_visited.get();
+            totals.distances_computed += distances_computed.get();
+            totals.backtracks += backtracks.get();
+            totals.pruned += pruned.get();
+            for (size_t b = 0; b < StatsHistogram::BUCKETS; ++b) {
+                totals.latency_ns.counts[b] += latency_ns[b].get();
+                totals.nodes.counts[b] += nodes[b].get();
+                totals.backtrack_counts.counts[b] += backtrack_counts[b].get();
+            }
+        }
+
+        void clear() {
+            queries.clear();
+            nodes_visited.clear();
+            leaves_visited.clear();
+            distances_computed.clear();
+            backtracks.clear();
+            pruned.clear();
+            for (size_t b = 0; b < StatsHistogram::BUCKETS; ++b) {
+                latency_ns[b].clear();
+                nodes[b].clear();
+                backtrack_counts[b].clear();
+            }
+        }
+    };
+
+    struct Registry {
+        std::mutex mutex;                 // guards everything below
+        std::vector<ThreadBlock*> blocks; // blocks of the live threads
+        SearchStatsSnapshot retired;      // query totals of threads that have exited, and the build totals
+    };
+
+    // Never destroyed, threads may still retire their blocks while statics are torn down
+    Registry& registry() {
+        static Registry* instance = new Registry();
+        return *instance;
+    }
+
+    // Registers the thread's block on first use and folds it into the retired totals on thread exit
+    struct ThreadHandle {
+        ThreadBlock block;
+
+        ThreadHandle() {
+            Registry& stats = registry();
+            std::lock_guard<std::mutex> lock(stats.mutex);
+            stats.blocks.push_back(&block);
+        }
+
+        ~ThreadHandle() {
+            Registry& stats = registry();
+            std::lock_guard<std::mutex> lock(stats.mutex);
+            block.addTo(stats.retired);
+            stats.blocks.erase(std::find(stats.blocks.begin(), stats.blocks.end(), &block));
+        }
+    };
+
+    ThreadBlock& threadBlock() {
+        static thread_local ThreadHandle handle;
+        return handle.block;
+    }
+}
+
+StatsHistogram::StatsHistogram() {
+    std::fill(counts, counts + BUCKETS, 0);
+}
+
+size_t StatsHistogram::bucketOf(uint64_t value) {
+    return value == 0 ? 0 : 64 - static_cast<size_t>(__builtin_clzll(value));
+}
+
+uint64_t StatsHistogram::total() const {
+    uint64_t sum = 0;
+    for (size_t b = 0; b < BUCKETS; ++b) {
+        sum += counts[b];
+    }
+    return sum;
+}
+
+uint64_t StatsHistogram::percentile(double p) const {
+    uint64_t count = total();
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100.0 * count)));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < BUCKETS; ++b) {
+        seen += counts[b];
+        if (seen >= rank) {
+            return b == 0 ? 0 : (b == 64 ? UINT64_MAX : (uint64_t(1) << b) - 1);
+        }
+    }
+    return UINT64_MAX;
+}
+
+KDTreeShape::KDTreeShape()
+        : nodes(0), leaves(0), points(0), max_depth(0), mean_leaf_depth(0.0), min_leaf_points(0),
+          max_leaf_points(0), leaf_fill(0.0), max_imbalance(0.0) {
+}
+
+SearchStatsSnapshot::SearchStatsSnapshot()
+        : queries(0), nodes_visited(0), leaves_visited(0), distances_computed(0), backtracks(0), pruned(0),
+          builds(0), build_seconds(0.0) {
+}
+
+void SearchStatsSnapshot::report(std::ostream& out) const {
+    double perQuery = queries > 0 ? 1.0 / static_cast<double>(queries) : 0.0;
+    out << "queries: " << queries << "\n";
+    out << "per query: " << nodes_visited * perQuery << " nodes, " << leaves_visited * perQuery << " leaves, "
+        << distances_computed * perQuery << " distances, " << backtracks * perQuery << " backtracks, "
+        << pruned * perQuery << " pruned\n";
+    out << "latency ns p50/p90/p99 <= " << latency_ns.percentile(50) << " / " << latency_ns.percentile(90)
+        << " / " << latency_ns.percentile(99) << "\n";
+    out << "nodes p50/p90/p99 <= " << nodes.percentile(50) << " / " << nodes.percentile(90) << " / "
+        << nodes.percentile(99) << "\n";
+    out << "backtracks p50/p90/p99 <= " << backtrack_counts.percentile(50) << " / "
+        << backtrack_counts.percentile(90) << " / " << backtrack_counts.percentile(99) << "\n";
+    out << "builds: " << builds << " in " << build_seconds << " s\n";
+    if (builds > 0) {
+        out << "last build: " << last_build.points << " points, " << last_build.nodes << " nodes, "
+            << last_build.leaves << " leaves, depth " << last_build.max_depth << " (mean "
+            << last_build.mean_leaf_depth << "), leaf points " << last_build.min_leaf_points << ".."
+            << last_build.max_leaf_points << ", fill " << last_build.leaf_fill << ", max imbalance "
+            << last_build.max_imbalance << "\n";
+    }
+}
+
+void SearchStats::recordQuery(uint64_t nodesVisited, uint64_t leavesVisited, uint64_t distancesComputed,
+                              uint64_t backtracks, uint64_t pruned, uint64_t nanoseconds) {
+    ThreadBlock& block = threadBlock();
+    block.queries.add(1);
+    block.nodes_visited.add(nodesVisited);
+    block.leaves_visited.add(leavesVisited);
+    block.distances_computed.add(distancesComputed);
+    block.backtracks.add(backtracks);
+    block.pruned.add(pruned);
+    block.latency_ns[StatsHistogram::bucketOf(nanoseconds)].add(1);
+    block.nodes[StatsHistogram::bucketOf(nodesVisited)].add(1);
+    block.backtrack_counts[StatsHistogram::bucketOf(backtracks)].add(1);
+}
+
+void SearchStats::recordBuild(const KDTreeShape& shape, double seconds) {
+    // Builds are rare next to queries, they go straight to the shared totals
+    Registry& stats = registry();
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    ++stats.retired.builds;
+    stats.retired.build_seconds += seconds;
+    stats.retired.last_build = shape;
+}
+
+SearchStatsSnapshot SearchStats::collect() {
+    Registry& stats = registry();
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    SearchStatsSnapshot totals = stats.retired;
+    for (const ThreadBlock* block : stats.blocks) {
+        block->addTo(totals);
+    }
+    return totals;
+}
+
+void SearchStats::reset() {
+    Registry& stats = registry();
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    stats.retired = SearchStatsSnapshot();
+    for (ThreadBlock* block : stats.blocks) {
+        block->clear();
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef SEARCH_STATS_H
+#define SEARCH_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Search instrumentation, off unless built with -DKNN_SEARCH_STATS=1. Instrumentation points
+// in the search and build code are wrapped in KNN_STATS(...), which compiles to nothing when
+// disabled, so the default build carries no extra work on its hot paths.
+#ifndef KNN_SEARCH_STATS
+#define KNN_SEARCH_STATS 0
+#endif
+
+#if KNN_SEARCH_STATS
+#define KNN_STATS(...) __VA_ARGS__
+#else
+#define KNN_STATS(...)
+#endif
+
+// Power-of-two histogram: bucket 0 counts zeros, bucket b counts values in [2^(b-1), 2^b)
+struct StatsHistogram {
+    static const size_t BUCKETS = 65;
+    uint64_t counts[BUCKETS];
+
+    StatsHistogram();
+
+    static size_t bucketOf(uint64_t value);
+    uint64_t total() const;
+    // Upper end of the bucket holding the p-th percentile (p in [0, 100]), 0 if empty
+    uint64_t percentile(double p) const;
+};
+
+// Shape of a built KD-tree
+struct KDTreeShape {
+    size_t nodes;
+    size_t leaves;
+    size_t points;
+    size_t max_depth;       // edges from the root to the deepest leaf
+    double mean_leaf_depth; // averaged over points, i.e. the expected descent of a query
+    size_t min_leaf_points;
+    size_t max_leaf_points;
+    double leaf_fill;       // mean points per leaf over the bucket size
+    double max_imbalance;   // largest share of an internal node's points on one side, 0.5 is perfect balance
+
+    KDTreeShape();
+};
+
+// Totals of all threads since the last reset
+struct SearchStatsSnapshot {
+    uint64_t queries;    // KD_Tree searches, a KDForest search counts once per shard
+    uint64_t nodes_visited;
+    uint64_t leaves_visited;
+    uint64_t distances_computed;
+    uint64_t backtracks; // far sides of split planes that were searched
+    uint64_t pruned;     // far sides skipped because they could not hold a closer point
+    StatsHistogram latency_ns;
+    StatsHistogram nodes;
+    StatsHistogram backtrack_counts;
+
+    uint64_t builds;
+    double build_seconds;
+    KDTreeShape last_build;
+
+    SearchStatsSnapshot();
+
+    // Human-readable summary, one line per quantity
+    void report(std::ostream& out) const;
+};
+
+// Aggregates KD_Tree search and build statistics. Every thread writes to a block of its own
+// (no locks, no shared cache lines on the query path), collect() merges the blocks on demand.
+class SearchStats {
+public:
+    static bool enabled() { return KNN_SEARCH_STATS != 0; }
+
+    static void recordQuery(uint64_t nodesVisited, uint64_t leavesVisited, uint64_t distancesComputed,
+                            uint64_t backtracks, uint64_t pruned, uint64_t nanoseconds);
+    static void recordBuild(const KDTreeShape& shape, double seconds);
+
+    static SearchStatsSnapshot collect();
+    // Zeroes every block, counts of searches running meanwhile may partly survive
+    static void reset();
+};
+
+#endif // SEARCH_STATS_H
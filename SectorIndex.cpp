@@ -0,0 +1,133 @@
+#include <algorithm>
+#include "SectorIndex.h"
+
+namespace {
+
+    // Tree order of the sectors: by x, then y, then z
+    bool lessThan(const Sector* a, const Sector* b) {
+        if (a->x != b->x) {
+            return a->x < b->x;
+        }
+        if (a->y != b->y) {
+            return a->y < b->y;
+        }
+        return a->z < b->z;
+    }
+
+    size_t depthOf(const Sector* root, const Sector* target) {
+        size_t depth = 0;
+        const Sector* node = root;
+        while (node != nullptr && node != target) {
+            node = lessThan(target, node) ? node->left : node->right;
+            ++depth;
+        }
+        return depth;
+    }
+
+    // Whether a comes before b in preorder: a is an ancestor of b, or the paths split with a on the left
+    bool precedesInPreorder(const Sector* root, const Sector* a, const Sector* b) {
+        const Sector* node = root;
+        while (node != nullptr) {
+            if (node == a) {
+                return true;
+            }
+            if (node == b) {
+                return false;
+            }
+            bool aLeft = lessThan(a, node);
+            if (aLeft != lessThan(b, node)) {
+                return aLeft;
+            }
+            node = aLeft ? node->left : node->right;
+        }
+        return false;
+    }
+}
+
+void SectorIndex::insert(Sector* sector) {
+    sectors[sector->sector_code].push_back(sector);
+}
+
+void SectorIndex::erase(Sector* sector) {
+    auto bucket = sectors.find(sector->sector_code);
+    if (bucket == sectors.end()) {
+        return;
+    }
+
+    std::vector<Sector*>& candidates = bucket->second;
+    auto position = std::find(candidates.begin(), candidates.end(), sector);
+    if (position == candidates.end()) {
+        return;
+    }
+    *position = candidates.back();
+    candidates.pop_back();
+    if (candidates.empty()) {
+        sectors.erase(bucket);
+    }
+}
+
+void SectorIndex::clear() {
+    sectors.clear();
+}
+
+size_t SectorIndex::size() const {
+    size_t count = 0;
+    for (const auto& bucket : sectors) {
+        count += bucket.second.size();
+    }
+    return count;
+}
+
+const std::vector<Sector*>* SectorIndex::find(const std::string& sector_code) const {
+    auto bucket = sectors.find(sector_code);
+    return bucket != sectors.end() ? &bucket->second : nullptr;
+}
+
+Sector* SectorIndex::firstInPreorder(const Sector* root, const std::string& sector_code) const {
+    const std::vector<Sector*>* candidates = find(sector_code);
+    if (candidates == nullptr) {
+        return nullptr;
+    }
+
+    // Codes are usually unique, then there is nothing to compare
+    Sector* first = candidates->front();
+    for (size_t i = 1; i < candidates->size(); ++i) {
+        if (precedesInPreorder(root, (*candidates)[i], first)) {
+            first = (*candidates)[i];
+        }
+    }
+    return first;
+}
+
+Sector* SectorIndex::firstInLevelOrder(const Sector* root, const std::string& sector_code) const {
+    const std::vector<Sector*>* candidates = find(sector_code);
+    if (candidates == nullptr) {
+        return nullptr;
+    }
+
+    Sector* first = candidates->front();
+    size_t firstDepth = candidates->size() > 1 ? depthOf(root, first) : 0;
+    for (size_t i = 1; i < candidates->size(); ++i) {
+        Sector* candidate = (*candidates)[i];
+        size_t depth = depthOf(root, candidate);
+        // On one level a BFS visits the sectors left to right, which is their preorder
+        if (depth < firstDepth || (depth == firstDepth && precedesInPreorder(root, candidate, first))) {
+            first = candidate;
+            firstDepth = depth;
+        }
+    }
+    return first;
+}
+
+void SectorIndex::pathTo(Sector* root, const Sector* target, std::vector<Sector*>& path) {
+    path.clear();
+    Sector* node = root;
+    while (node != nullptr) {
+        path.push_back(node);
+        if (node == target) {
+            return;
+        }
+        node = lessThan(target, node) ? node->left : node->right;
+    }
+    path.clear();
+}
@@ -0,0 +1,38 @@
+#ifndef SECTORINDEX_H
+#define SECTORINDEX_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Sector.h"
+
+// Hash index from sector code to the sectors of a tree, so lookups by code skip the full-tree scan.
+// Codes only encode the rounded distance and the octant, so many coordinates share one. The trees
+// used to return the first match of a traversal; firstInPreorder and firstInLevelOrder pick that
+// same sector among the code's candidates by where they sit in the tree, which they find by
+// descending from the root by coordinates. Rotations relink nodes without changing their codes,
+// so they leave the index valid; only adding, removing or re-coding a sector has to update it.
+class SectorIndex {
+private:
+    std::unordered_map<std::string, std::vector<Sector*>> sectors; // code -> every sector with that code
+
+public:
+    void insert(Sector* sector);
+    void erase(Sector* sector); // looked up by its current sector_code
+    void clear();
+    size_t size() const;
+
+    // All sectors with the code in no particular order, nullptr if there are none
+    const std::vector<Sector*>* find(const std::string& sector_code) const;
+
+    // The sector a preorder DFS from root would reach first, nullptr if there is none
+    Sector* firstInPreorder(const Sector* root, const std::string& sector_code) const;
+    // The sector a BFS from root would reach first: the shallowest, then the leftmost
+    Sector* firstInLevelOrder(const Sector* root, const std::string& sector_code) const;
+
+    // Sectors from root down to target, both included; empty if target is not under root
+    static void pathTo(Sector* root, const Sector* target, std::vector<Sector*>& path);
+};
+
+#endif // SECTORINDEX_H
@@ -60,6 +60,7 @@ Sector* SpaceSectorBST::insertRecursive(Sector* node, Sector* parent, int x, int
     if (node == nullptr) {
         Sector* new_node = new Sector(x, y, z);
         new_node->parent = parent; // Set parent node
+        sector_index.insert(new_node);
         return new_node;
     }
 
@@ -106,6 +107,7 @@ void SpaceSectorBST::deleteLeafNode(Sector* nodeToDelete) {
         }
     }
 
+    sector_index.erase(nodeToDelete);
     delete nodeToDelete;
 }
 
@@ -124,17 +126,23 @@ void SpaceSectorBST::deleteNodeWithOneChild(Sector* nodeToDelete) {
 
     child->parent = nodeToDelete->parent;
 
+    sector_index.erase(nodeToDelete);
     delete nodeToDelete;
 }
 
 void SpaceSectorBST::deleteNodeWithTwoChildren(Sector* nodeToDelete) {
     Sector* successor = findMinNode(nodeToDelete->right);
 
+    // The two nodes trade codes, re-file both so the successor leaves the index with the deleted code
+    sector_index.erase(nodeToDelete);
+    sector_index.erase(successor);
     std::swap(nodeToDelete->x, successor->x);
     std::swap(nodeToDelete->y, successor->y);
     std::swap(nodeToDelete->z, successor->z);
     std::swap(nodeToDelete->distance_from_earth, successor->distance_from_earth);
     std::swap(nodeToDelete->sector_code, successor->sector_code);
+    sector_index.insert(nodeToDelete);
+    sector_index.insert(successor);
 
     if (successor->left != nullptr || successor->right != nullptr) {
         deleteNodeWithOneChild(successor);
@@ -198,7 +206,7 @@ void SpaceSectorBST::postorderTraversal(Sector* node) {
 
 std::vector<Sector*> SpaceSectorBST::getStellarPath(const std::string& sector_code) {
     std::vector<Sector*> path;
-    Sector* destination = findSector(root, sector_code); // Find target sector
+    Sector* destination = sector_index.firstInPreorder(root, sector_code); // Same sector findSector(root, ...) finds
 
     if (destination == nullptr) {
         return path;
@@ -238,7 +246,8 @@ Sector* SpaceSectorBST::findSector(Sector* node, const std::string& sector_code)
 }
 
 Sector* SpaceSectorBST::findSectorByCode(const std::string& sector_code) const {
-    return findSectorByCodeBFS(root, sector_code);
+    // Same sector findSectorByCodeBFS(root, ...) finds, without the scan
+    return sector_index.firstInLevelOrder(root, sector_code);
 }
 
 Sector* SpaceSectorBST::findSectorByCodeBFS(Sector* startNode, const std::string& sector_code) const {
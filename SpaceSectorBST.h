@@ -7,9 +7,12 @@
 #include <vector>
 
 #include "Sector.h"
+#include "SectorIndex.h"
 
 class SpaceSectorBST {
-  
+private:
+    SectorIndex sector_index; // every sector under its code, kept in step by insert and delete
+
 public:
     Sector *root;
     SpaceSectorBST();
@@ -66,6 +66,7 @@ Sector* SpaceSectorLLRBT::insertRecursive(Sector* node, Sector* parent, int x, i
         Sector* new_node = new Sector(x, y, z);
         new_node->parent = parent; // Ebeveyn düğümü ayarla
         new_node->color = true;
+        sector_index.insert(new_node);
         return new_node;
     }
 
@@ -239,42 +240,33 @@ bool SpaceSectorLLRBT::getPath(Sector* root, std::vector<string>& path, string x
 std::vector<Sector*> SpaceSectorLLRBT::getStellarPath(const std::string& sector_code) {
     std::vector<Sector*> path;
 
-    // Earth ve Dr. Elara düğümlerini bul
-    Sector* earth = findSector(root, "0SSS");
-    Sector* elara = findSector(root, sector_code);
+    // Earth ve Dr. Elara düğümlerini bul, findSector(root, ...) ile aynı düğümler
+    Sector* earth = sector_index.firstInPreorder(root, "0SSS");
+    Sector* elara = sector_index.firstInPreorder(root, sector_code);
 
     if (earth == nullptr || elara == nullptr) {
         return path;
     }
 
-    // Yeni algoritma için gerekli yapıları oluşturma ve çağırma
-    std::vector<string> path1, path2;
-    getPath(root, path1, "0SSS"); // Earth'ü kök düğüm kabul ederek yolu bulma
-    getPath(root, path2, sector_code); // Hedef düğüme kadar olan yolu bulma
+    // Kökten iki düğüme inen yollar, koordinatlara göre O(derinlik)
+    std::vector<Sector*> path1, path2;
+    SectorIndex::pathTo(root, earth, path1);
+    SectorIndex::pathTo(root, elara, path2);
 
-    int intersection = -1;
-
-    // Kesişim noktasını bulma
-    int i = 0, j = 0;
-    while (i != path1.size() || j != path2.size()) {
-        if (i == j && path1[i] == path2[j]) {
-            i++;
-            j++;
-        } else {
-            intersection = j - 1;
-            break;
-        }
+    // Kesişim noktası: iki yolun son ortak düğümü
+    size_t intersection = 0;
+    while (intersection + 1 < path1.size() && intersection + 1 < path2.size() &&
+           path1[intersection + 1] == path2[intersection + 1]) {
+        intersection++;
     }
 
-    // Yolu oluşturma
-    for (int i = path1.size() - 1; i > intersection; i--) {
-        Sector* sector = findSector(root, (path1[i]));
-        path.push_back(sector);
+    // Yolu oluşturma: Earth'ten kesişime çık, oradan Dr. Elara'ya in
+    for (size_t i = path1.size() - 1; i > intersection; i--) {
+        path.push_back(path1[i]);
     }
 
-    for (int i = intersection; i < path2.size(); i++) {
-        Sector* sector = findSector(root, (path2[i]));
-        path.push_back(sector);
+    for (size_t i = intersection; i < path2.size(); i++) {
+        path.push_back(path2[i]);
     }
 
     return path;
@@ -2,6 +2,7 @@
 #define SPACESECTORLLRBT_H
 
 #include "Sector.h"
+#include "SectorIndex.h"
 #include <iostream>
 #include <fstream>  
 #include <sstream>
@@ -10,6 +11,9 @@
 #include <stack>
 
 class SpaceSectorLLRBT {
+private:
+    SectorIndex sector_index; // every sector under its code, rotations leave it valid
+
 public:
     Sector* root;
     SpaceSectorLLRBT();
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include "ThreadPool.h"
+
+namespace {
+
+    // Pool whose loop body the current thread is running, if any
+    thread_local const ThreadPool* running_pool = nullptr;
+}
+
+ThreadPool::ThreadPool(size_t threadCount)
+        : workerCount(threadCount), generation(0), busyWorkers(0), stopping(false),
+          body(nullptr), loopCount(0), loopChunk(1) {
+    if (workerCount == 0) {
+        workerCount = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+
+    shares.reset(new Share[workerCount]);
+    for (size_t i = 0; i < workerCount; ++i) {
+        shares[i].next.store(0);
+        shares[i].end = 0;
+    }
+
+    // Worker 0 is whichever thread calls parallelFor, only the helpers get their own thread
+    threads.reserve(workerCount - 1);
+    for (size_t worker = 1; worker < workerCount; ++worker) {
+        threads.emplace_back(&ThreadPool::workerLoop, this, worker);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return workerCount;
+}
+
+void ThreadPool::parallelFor(size_t count, size_t chunkSize, const LoopBody& loopBody) {
+    if (count == 0) {
+        return;
+    }
+    chunkSize = std::max<size_t>(1, chunkSize);
+
+    // Nothing to share out, run inline
+    if (workerCount == 1 || count <= chunkSize) {
+        loopBody(0, count, 0);
+        return;
+    }
+
+    std::lock_guard<std::mutex> runLock(runMutex);
+    runLoop(count, chunkSize, loopBody);
+}
+
+bool ThreadPool::tryParallelFor(size_t count, size_t chunkSize, const LoopBody& loopBody) {
+    if (count == 0) {
+        return true;
+    }
+    chunkSize = std::max<size_t>(1, chunkSize);
+
+    if (workerCount == 1 || count <= chunkSize) {
+        loopBody(0, count, 0);
+        return true;
+    }
+
+    // A loop body already holds runMutex on this thread, locking it again is not allowed even to try
+    if (running_pool == this) {
+        return false;
+    }
+    std::unique_lock<std::mutex> runLock(runMutex, std::try_to_lock);
+    if (!runLock.owns_lock()) {
+        return false;
+    }
+    runLoop(count, chunkSize, loopBody);
+    return true;
+}
+
+void ThreadPool::runLoop(size_t count, size_t chunkSize, const LoopBody& loopBody) {
+    // Hand every worker a contiguous run of chunk indices
+    size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+    for (size_t worker = 0; worker < workerCount; ++worker) {
+        shares[worker].next.store(chunkCount * worker / workerCount, std::memory_order_relaxed);
+        shares[worker].end = chunkCount * (worker + 1) / workerCount;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        body = &loopBody;
+        loopCount = count;
+        loopChunk = chunkSize;
+        busyWorkers = workerCount - 1;
+        ++generation;
+    }
+    wake.notify_all();
+
+    runShares(0);
+
+    std::unique_lock<std::mutex> lock(stateMutex);
+    finished.wait(lock, [this] { return busyWorkers == 0; });
+    body = nullptr;
+}
+
+void ThreadPool::workerLoop(size_t worker) {
+    size_t seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            wake.wait(lock, [this, seenGeneration] { return stopping || generation != seenGeneration; });
+            if (stopping) {
+                return;
+            }
+            seenGeneration = generation;
+        }
+
+        runShares(worker);
+
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            --busyWorkers;
+        }
+        finished.notify_one();
+    }
+}
+
+void ThreadPool::runShares(size_t worker) {
+    const ThreadPool* outer = running_pool;
+    running_pool = this;
+
+    // Own share first, then walk the other workers' shares and steal what is left
+    for (size_t offset = 0; offset < workerCount; ++offset) {
+        Share& share = shares[(worker + offset) % workerCount];
+        while (true) {
+            size_t chunk = share.next.fetch_add(1, std::memory_order_relaxed);
+            if (chunk >= share.end) {
+                break;
+            }
+            size_t begin = chunk * loopChunk;
+            size_t end = std::min(loopCount, begin + loopChunk);
+            (*body)(begin, end, worker);
+        }
+    }
+
+    running_pool = outer;
+}
@@ -0,0 +1,68 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of persistent worker threads for data-parallel loops.
+// parallelFor splits [0, count) into chunks and gives every worker a
+// contiguous share of them; a worker that finishes its share steals the
+// remaining chunks of the others, so uneven chunks still balance out.
+class ThreadPool {
+public:
+    // Body of a parallel loop: processes [begin, end) on the given worker (0 .. size() - 1)
+    typedef std::function<void(size_t begin, size_t end, size_t worker)> LoopBody;
+
+    explicit ThreadPool(size_t threadCount = 0); // 0 uses std::thread::hardware_concurrency()
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of workers, the calling thread of parallelFor counts as worker 0
+    size_t size() const;
+
+    // Runs body over [0, count) in chunks of chunkSize and returns once every chunk is done.
+    // Calls are serialized; calling parallelFor from inside a loop body is not supported.
+    void parallelFor(size_t count, size_t chunkSize, const LoopBody& body);
+
+    // Same as parallelFor while no other loop is running. Returns false without running body
+    // if one is, including when called from inside a loop body of this pool.
+    bool tryParallelFor(size_t count, size_t chunkSize, const LoopBody& body);
+
+private:
+    // Chunk cursor of one worker, padded so owners and thieves do not false-share
+    struct alignas(64) Share {
+        std::atomic<size_t> next;
+        size_t end;
+    };
+
+    // Shares out and runs one loop, runMutex must be held
+    void runLoop(size_t count, size_t chunkSize, const LoopBody& body);
+    void workerLoop(size_t worker);
+    void runShares(size_t worker);
+
+    std::vector<std::thread> threads;
+    std::unique_ptr<Share[]> shares;
+    size_t workerCount;
+
+    std::mutex runMutex;    // serializes parallelFor calls
+    std::mutex stateMutex;  // guards the fields below
+    std::condition_variable wake;
+    std::condition_variable finished;
+    size_t generation;      // bumped for every new loop
+    size_t busyWorkers;     // helper threads still working on the current loop
+    bool stopping;
+
+    const LoopBody* body;   // current loop
+    size_t loopCount;
+    size_t loopChunk;
+};
+
+#endif // THREAD_POOL_H
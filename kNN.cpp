@@ -1,59 +1,611 @@
 #include "kNN.h"
+#include "KNNJoin.h"
+#include "ModelFile.h"
+#include <algorithm>
+#include <chrono>
 #include <cmath> // For mathematical functions like sqrt
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+    // Upper bound on the distance terms the brute force side of the backend calibration computes
+    const size_t calibration_budget = 1 << 22;
+    const size_t calibration_queries = 64;
+
+    // BACKEND_AUTO's cost model, in distance terms (one feature of one point) per query. Both
+    // backends pay about point_cost terms per scanned point on top of its features, for the heap
+    // offer; the tree also pays node_cost per level of the descent for every leaf it scans.
+    // Fitted to single queries on uniform data, 2-32 dims, 500-100k rows, leaves of 8 and 32.
+    const double point_cost = 4.0;
+    const double node_cost = 32.0;
+
+    // The ball tree only joins the calibration from this many dimensions on, below it the
+    // KD-tree prunes well and the ball tree would just double the memory
+    const size_t ball_tree_min_dimensions = 10;
+
+    // Per-thread buffers of single-query predictions, they only grow, so steady-state queries
+    // do not allocate
+    struct QueryScratch {
+        KDTreeQuery search;
+        std::vector<double> scaled;
+        std::vector<double> votes;
+
+        QueryScratch() : search(nullptr, 0) {}
+    };
+
+    QueryScratch& queryScratch() {
+        static thread_local QueryScratch scratch;
+        return scratch;
+    }
+}
 
 // Constructor implementation
-KNN::KNN(int neighbors, double threshold) : k(neighbors), split_threshold(threshold) {}
+KNN::KNN(int neighbors, double threshold)
+        : thread_count(0), batch_chunk_size(64), vote_rule(VOTE_MAJORITY), positive_label("Habitable"),
+          backend(BACKEND_AUTO), active_backend(BACKEND_KD_TREE), feature_storage_set(false), brute_stale(true),
+          ball(threshold), ball_stale(true), forest(threshold), forest_stale(true), tree(threshold), k(neighbors),
+          split_threshold(threshold) {}
+
+ThreadPool& KNN::threadPool() {
+    if (!pool) {
+        pool.reset(new ThreadPool(thread_count));
+    }
+    return *pool;
+}
+
+const double* KNN::scaleQuery(const Point& queryPoint, std::vector<double>& buffer) const {
+    if (!scaler.fitted()) {
+        return queryPoint.features.data();
+    }
+    buffer.resize(scaler.dimensions());
+    scaler.transform(queryPoint.features.data(), buffer.data());
+    return buffer.data();
+}
 
 // Train function implementation
-void KNN::train(Dataset& data) {
-    // Standardize the data
-    for (size_t j = 0; j < data.points[0].features.size(); ++j) {
-        double mean_of_feature_j = 0.0;
-        double std_dev_of_feature_j = 0.0;
+void KNN::train(const Dataset& data) {
+    if (data.points.empty()) {
+        std::cerr << "Cannot train on an empty dataset" << std::endl;
+        return;
+    }
+
+    // Standardize the data into a columnar copy the tree is built from
+    ColumnarDataset scaled;
+    scaler.fit(data.points, threadPool());
+    scaler.transform(data.points, scaled.features, threadPool());
+    scaled.label_ids.resize(data.points.size());
+    for (size_t i = 0; i < data.points.size(); ++i) {
+        scaled.label_ids[i] = scaled.labels.intern(data.points[i].label);
+    }
+
+    // Build the KD_Tree
+    tree.build(scaled);
+    chooseBackend();
+}
 
-        // Calculate mean of feature_j
-        for (size_t i = 0; i < data.points.size(); ++i) {
-            mean_of_feature_j += data.points[i].features[j];
+void KNN::train(const ColumnarDataset& data) {
+    if (data.size() == 0) {
+        std::cerr << "Cannot train on an empty dataset" << std::endl;
+        return;
+    }
+
+    ColumnarDataset scaled;
+    scaler.fit(data.features, threadPool());
+    scaler.transform(data.features, scaled.features, threadPool());
+    scaled.label_ids = data.label_ids;
+    scaled.labels = data.labels;
+
+    // Build the KD_Tree
+    tree.build(scaled);
+    chooseBackend();
+}
+
+void KNN::chooseBackend() {
+    brute_stale = true;
+    ball_stale = true;
+    forest_stale = true;
+    if (ball.getMetric() != METRIC_EUCLIDEAN) {
+        active_backend = BACKEND_BALL_TREE;
+        return;
+    }
+    if (backend == BACKEND_AUTO) {
+        active_backend = estimateBackend(tree.size(), tree.getFeatures().dimensions(), static_cast<size_t>(std::max(k, 0)),
+                                         tree.getLeafSize());
+    } else if (backend == BACKEND_CALIBRATED) {
+        calibrateBackend();
+    } else {
+        active_backend = backend;
+    }
+}
+
+KNNBackend KNN::estimateBackend(size_t rows, size_t dims, size_t k, size_t leafSize) {
+    if (rows < 2 || dims == 0 || k == 0) {
+        return BACKEND_KD_TREE;
+    }
+
+    // Points a kNN search scans in a KD-tree with buckets of leafSize points, after Friedman,
+    // Bentley and Finkel: leafSize * ((k / leafSize)^(1/d) + 1)^d. That assumes an unbounded
+    // set, on a finite one it saturates smoothly towards every point.
+    double points = static_cast<double>(rows);
+    double bucket = static_cast<double>(std::max<size_t>(1, leafSize));
+    double scanned = bucket * std::pow(std::pow(k / bucket, 1.0 / dims) + 1.0, static_cast<double>(dims));
+    scanned = points * (1.0 - std::exp(-scanned / points));
+    double depth = std::log2(std::max(2.0, points / bucket));
+
+    double treeCost = scanned * (dims + point_cost) + node_cost * depth * (scanned / bucket);
+    double bruteCost = points * (dims + point_cost);
+    return bruteCost < treeCost ? BACKEND_BRUTE_FORCE : BACKEND_KD_TREE;
+}
+
+void KNN::calibrateBackend() {
+    active_backend = BACKEND_KD_TREE;
+    const FeatureMatrix& features = tree.getFeatures();
+    size_t rows = features.size();
+    size_t dims = features.dimensions();
+    if (rows < 2 || dims == 0) {
+        return;
+    }
+
+    // Sample queries halfway between pairs of training rows, fewer of them on large sets so the
+    // brute force timing stays within calibration_budget
+    size_t sampleCount = std::max<size_t>(1, std::min(calibration_queries, calibration_budget / (rows * dims)));
+    std::vector<std::vector<double>> samples(sampleCount, std::vector<double>(dims));
+    std::vector<KDTreeQuery> searches;
+    for (size_t i = 0; i < sampleCount; ++i) {
+        size_t a = i * rows / sampleCount;
+        size_t b = (a + rows / 2 + 1) % rows;
+        for (size_t d = 0; d < dims; ++d) {
+            samples[i][d] = (features.at(a, d) + features.at(b, d)) / 2;
         }
-        mean_of_feature_j /= data.points.size();
+        searches.emplace_back(samples[i].data(), k, search_options);
+    }
+
+    brute.index(tree);
+    brute_stale = false;
 
-        // Calculate standard deviation of feature_j
-        for (size_t i = 0; i < data.points.size(); ++i) {
-            std_dev_of_feature_j += pow(data.points[i].features[j] - mean_of_feature_j, 2);
+    auto start = std::chrono::steady_clock::now();
+    for (auto& search : searches) {
+        tree.kNN(search);
+    }
+    auto bestTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    brute.kNN(features, searches.data(), searches.size());
+    auto bruteTime = std::chrono::steady_clock::now() - start;
+    if (bruteTime < bestTime) {
+        active_backend = BACKEND_BRUTE_FORCE;
+        bestTime = bruteTime;
+    }
+
+    if (dims >= ball_tree_min_dimensions) {
+        ball.build(tree);
+        ball_stale = false;
+
+        start = std::chrono::steady_clock::now();
+        for (auto& search : searches) {
+            ball.kNN(search);
         }
-        std_dev_of_feature_j = sqrt(std_dev_of_feature_j / data.points.size());
+        if (std::chrono::steady_clock::now() - start < bestTime) {
+            active_backend = BACKEND_BALL_TREE;
+        } else {
+            ball.clear();
+            ball_stale = true;
+        }
+    }
+}
 
-        // Standardize each feature
-        for (size_t i = 0; i < data.points.size(); ++i) {
-            data.points[i].features[j] = (data.points[i].features[j] - mean_of_feature_j) / std_dev_of_feature_j;
+void KNN::refreshBackend() const {
+    // Double-checked, so queries against an up to date model never take the lock
+    if (active_backend == BACKEND_BRUTE_FORCE && brute_stale.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(backend_mutex);
+        if (brute_stale.load(std::memory_order_relaxed)) {
+            brute.index(tree);
+            brute_stale.store(false, std::memory_order_release);
+        }
+    }
+    if (active_backend == BACKEND_BALL_TREE && ball_stale.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(backend_mutex);
+        if (ball_stale.load(std::memory_order_relaxed)) {
+            ball.build(tree);
+            ball_stale.store(false, std::memory_order_release);
         }
     }
+    if (active_backend == BACKEND_KD_FOREST && forest_stale.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(backend_mutex);
+        if (forest_stale.load(std::memory_order_relaxed)) {
+            forest.build(tree);
+            forest_stale.store(false, std::memory_order_release);
+        }
+    }
+}
 
-    // Build the KD_Tree
-    tree.build(data);
+void KNN::prepare() const {
+    refreshBackend();
+}
+
+void KNN::findNeighbors(KDTreeQuery* searches, size_t count, bool concurrent) const {
+    if (active_backend == BACKEND_BRUTE_FORCE) {
+        brute.kNN(tree.getFeatures(), searches, count);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (active_backend == BACKEND_BALL_TREE) {
+            ball.kNN(searches[i]);
+        } else if (active_backend == BACKEND_KD_FOREST) {
+            forest.kNN(searches[i], concurrent);
+        } else {
+            tree.kNN(searches[i]);
+        }
+    }
+}
+
+uint32_t KNN::labelOf(uint32_t row) const {
+    if (active_backend == BACKEND_BALL_TREE) {
+        return ball.getLabelId(row);
+    }
+    return active_backend == BACKEND_KD_FOREST ? forest.getLabelId(row) : tree.getLabelId(row);
+}
+
+void KNN::setBackend(KNNBackend requested) {
+    backend = requested;
+    chooseBackend();
+}
+
+KNNBackend KNN::getActiveBackend() const {
+    return active_backend;
+}
+
+void KNN::setDistanceMetric(DistanceMetric metric) {
+    if (metric != ball.getMetric()) {
+        ball.setMetric(metric);
+        chooseBackend();
+    }
+}
+
+DistanceMetric KNN::getDistanceMetric() const {
+    return ball.getMetric();
+}
+
+void KNN::setShardCount(size_t shards) {
+    forest.setShardCount(shards);
+    forest_stale = true;
+}
+
+Prediction KNN::classify(const Point& queryPoint) const {
+    QueryScratch& scratch = queryScratch();
+    scratch.search.query = scaleQuery(queryPoint, scratch.scaled);
+    scratch.search.k = k;
+    scratch.search.options = search_options;
+    refreshBackend();
+    findNeighbors(&scratch.search, 1, true);
+    return vote(scratch.search.heap.data(), scratch.search.heap.size(), scratch.votes);
+}
+
+void KNN::classifyEachK(const Point& queryPoint, const std::vector<size_t>& ks, Prediction* out) const {
+    QueryScratch& scratch = queryScratch();
+    scratch.search.query = scaleQuery(queryPoint, scratch.scaled);
+    scratch.search.k = ks.empty() ? 0 : *std::max_element(ks.begin(), ks.end());
+    scratch.search.options = search_options;
+    refreshBackend();
+    findNeighbors(&scratch.search, 1, true);
+    classifyEachK(scratch.search.heap.data(), scratch.search.heap.size(), ks, out);
+}
+
+void KNN::classifyEachK(const std::pair<double, uint32_t>* neighbors, size_t count, const std::vector<size_t>& ks,
+                        Prediction* out) const {
+    std::vector<double>& votes = queryScratch().votes;
+    for (size_t i = 0; i < ks.size(); ++i) {
+        out[i] = vote(neighbors, std::min(ks[i], count), votes);
+    }
+}
+
+const LabelTable& KNN::getLabels() const {
+    return tree.getLabels();
 }
 
 // Predict function implementation
-int KNN::predict(const Point& queryPoint) {
+int KNN::predict(const Point& queryPoint) const {
+    size_t nodesVisited = 0;
+    return predict(queryPoint, nodesVisited);
+}
+
+int KNN::predict(const Point& queryPoint, size_t& nodesVisited) const {
     // Traverse the KD_Tree to find k nearest neighbors
-    std::vector<Point> neighbors = tree.kNN(queryPoint, k);
+    QueryScratch& scratch = queryScratch();
+    scratch.search.query = scaleQuery(queryPoint, scratch.scaled);
+    scratch.search.k = k;
+    scratch.search.options = search_options;
+    refreshBackend();
+    findNeighbors(&scratch.search, 1, true);
+    nodesVisited = scratch.search.nodes_visited;
+
+    Prediction result = vote(scratch.search.heap.data(), scratch.search.heap.size(), scratch.votes);
+    return result.label_id != LabelTable::NOT_FOUND && result.label_id == tree.getLabels().find(positive_label) ? 1 : 0;
+}
+
+Prediction KNN::vote(const std::pair<double, uint32_t>* neighbors, size_t count, std::vector<double>& votes) const {
+    Prediction result = {LabelTable::NOT_FOUND, 0.0};
+    if (count == 0) {
+        return result;
+    }
 
-    // Perform majority voting to predict the label
-    // Count the number of habitable and non-habitable neighbors
-    int habitableCount = 0;
-    for (const auto& neighbor : neighbors) {
-        if (neighbor.label == "Habitable") {
-            ++habitableCount;
+    // Under distance weighting a neighbor at distance 0 would get an infinite weight,
+    // so if there are any, only the exact matches vote
+    bool exactMatch = false;
+    if (vote_rule == VOTE_DISTANCE_WEIGHTED) {
+        for (size_t i = 0; i < count; ++i) {
+            exactMatch = exactMatch || neighbors[i].first == 0.0;
         }
     }
 
-    // If at least one neighbor is habitable, predict label as 1 (habitable)
-    if (habitableCount > 0) {
-        return 1;
-    } else {
-        // If none of the neighbors are habitable, predict label as 0 (not habitable)
-        return 0;
+    // Histogram over label ids
+    votes.assign(tree.getLabels().size(), 0.0);
+    double total = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        const auto& neighbor = neighbors[i];
+        double weight = 1.0;
+        if (exactMatch) {
+            weight = neighbor.first == 0.0 ? 1.0 : 0.0;
+        } else if (vote_rule == VOTE_DISTANCE_WEIGHTED) {
+            double distance = active_backend == BACKEND_BALL_TREE ? ball.distanceFromKey(neighbor.first)
+                                                                  : std::sqrt(neighbor.first);
+            weight = 1.0 / distance;
+        }
+        votes[labelOf(neighbor.second)] += weight;
+        total += weight;
+    }
+
+    // Highest vote wins, a tie goes to the label with the closest neighbor
+    double bestVote = -1.0;
+    double bestDistance = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        const auto& neighbor = neighbors[i];
+        uint32_t id = labelOf(neighbor.second);
+        if (votes[id] > bestVote || (votes[id] == bestVote && neighbor.first < bestDistance)) {
+            result.label_id = id;
+            bestVote = votes[id];
+            bestDistance = neighbor.first;
+        }
+    }
+    result.confidence = total > 0.0 ? bestVote / total : 0.0;
+    return result;
+}
+
+void KNN::insert(const Point& point) {
+    if (scaler.fitted() && point.features.size() != scaler.dimensions()) {
+        std::cerr << "Cannot insert a point with " << point.features.size() << " features into a model of "
+                  << scaler.dimensions() << std::endl;
+        return;
+    }
+    Point scaled = point;
+    scaler.transform(point.features.data(), scaled.features.data());
+    tree.insert(scaled);
+    brute_stale = true;
+    ball_stale = true;
+    forest_stale = true;
+}
+
+bool KNN::remove(const Point& point) {
+    if (scaler.fitted() && point.features.size() != scaler.dimensions()) {
+        return false;
+    }
+    Point scaled = point;
+    scaler.transform(point.features.data(), scaled.features.data());
+    brute_stale = true;
+    ball_stale = true;
+    forest_stale = true;
+    return tree.remove(scaled);
+}
+
+std::vector<Prediction> KNN::classifyBatch(const Point* queries, size_t count) {
+    std::vector<Prediction> results(count);
+    if (count == 0) {
+        return results;
+    }
+
+    // Up front, the workers only read the backend
+    refreshBackend();
+
+    // One block of search states and scaled queries plus a vote histogram per worker, so the
+    // scratch buffers are reused across that worker's queries. Queries go to the backend a
+    // block at a time, which lets brute force share each pass over the training rows.
+    const size_t block = BruteForceSearch::query_block;
+    ThreadPool& workers = threadPool();
+    std::vector<std::vector<KDTreeQuery>> scratch(workers.size(),
+                                                  std::vector<KDTreeQuery>(block, KDTreeQuery(nullptr, k, search_options)));
+    std::vector<std::vector<std::vector<double>>> scaled(workers.size(), std::vector<std::vector<double>>(block));
+    std::vector<std::vector<double>> votes(workers.size());
+
+    workers.parallelFor(count, batch_chunk_size, [&](size_t begin, size_t end, size_t worker) {
+        std::vector<KDTreeQuery>& searches = scratch[worker];
+        for (size_t first = begin; first < end; first += block) {
+            size_t blockSize = std::min(block, end - first);
+            for (size_t i = 0; i < blockSize; ++i) {
+                searches[i].query = scaleQuery(queries[first + i], scaled[worker][i]);
+            }
+            findNeighbors(searches.data(), blockSize);
+            for (size_t i = 0; i < blockSize; ++i) {
+                results[first + i] = vote(searches[i].heap.data(), searches[i].heap.size(), votes[worker]);
+            }
+        }
+    });
+
+    return results;
+}
+
+std::vector<Prediction> KNN::classifyBulk(const std::vector<Point>& queries) {
+    // The join works on the KD-tree's Euclidean space and rows, the ball tree and the forest answer one query at a time
+    if (queries.empty() || tree.getRoot() == nullptr || active_backend == BACKEND_BALL_TREE ||
+        active_backend == BACKEND_KD_FOREST) {
+        return classifyBatch(queries.data(), queries.size());
+    }
+
+    // Tree over the scaled queries, with the training tree's bucket size
+    ColumnarDataset scaled;
+    scaler.transform(queries, scaled.features, threadPool());
+    KD_Tree queryTree(static_cast<double>(KD_Tree::leafSizeFor(split_threshold, tree.size())));
+    std::vector<uint32_t> sourceRows;
+    queryTree.build(scaled, sourceRows);
+
+    KNNJoin join;
+    join.join(queryTree, tree, k, &threadPool());
+
+    std::vector<Prediction> results(queries.size());
+    std::vector<double> votes;
+    for (uint32_t row = 0; row < join.rows(); ++row) {
+        results[sourceRows[row]] = vote(join.candidates(row), join.count(row), votes);
+    }
+    return results;
+}
+
+std::vector<int> KNN::predictBatch(const Point* queries, size_t count) {
+    std::vector<Prediction> results = classifyBatch(queries, count);
+    uint32_t positive = tree.getLabels().find(positive_label);
+
+    std::vector<int> labels(count);
+    for (size_t i = 0; i < count; ++i) {
+        labels[i] = positive != LabelTable::NOT_FOUND && results[i].label_id == positive ? 1 : 0;
+    }
+    return labels;
+}
+
+std::vector<int> KNN::predictBatch(const std::vector<Point>& queries) {
+    return predictBatch(queries.data(), queries.size());
+}
+
+void KNN::setVoteRule(VoteRule rule) {
+    vote_rule = rule;
+}
+
+void KNN::setPositiveLabel(const std::string& label) {
+    positive_label = label;
+}
+
+void KNN::setThreadCount(size_t threads) {
+    if (threads != thread_count) {
+        thread_count = threads;
+        pool.reset();
+    }
+}
+
+void KNN::setBatchChunkSize(size_t queriesPerChunk) {
+    batch_chunk_size = queriesPerChunk > 0 ? queriesPerChunk : 1;
+}
+
+void KNN::setSearchOptions(const KDTreeSearchOptions& options) {
+    search_options = options;
+}
+
+const KDTreeSearchOptions& KNN::getSearchOptions() const {
+    return search_options;
+}
+
+void KNN::setFeatureStorage(FeatureStorage storage, size_t rerankFactor) {
+    tree.setFeatureStorage(storage, rerankFactor);
+    feature_storage_set = true;
+}
+
+bool KNN::save(const std::string& filename) const {
+    // Written beside the target and renamed over it, so a model mapped from filename (loaded
+    // from it) is never truncated under its readers and a failed save keeps the old file
+    const std::string temporary = filename + ".tmp";
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Unable to open file: " << temporary << std::endl;
+        return false;
+    }
+
+    ModelFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+    header.version = MODEL_FILE_VERSION;
+    header.endian_tag = MODEL_FILE_ENDIAN_TAG;
+    header.k = k;
+    header.split_threshold = split_threshold;
+
+    // Header goes in last, once every section offset is known
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ModelFileWriter::writeSection(file, scaler.getMeans().data(), scaler.getMeans().size() * sizeof(double),
+                                  header.feature_means);
+    ModelFileWriter::writeSection(file, scaler.getScales().data(), scaler.getScales().size() * sizeof(double),
+                                  header.feature_scales);
+    tree.writeSections(file, header);
+    header.file_size = static_cast<uint64_t>(file.tellp());
+
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.close();
+
+    if (!file) {
+        std::cerr << "Unable to write model file: " << temporary << std::endl;
+        std::remove(temporary.c_str());
+        return false;
     }
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Unable to replace model file: " << filename << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
 }
 
-// Additional methods or helper functions can be added as needed
+bool KNN::load(const std::string& filename) {
+    std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>();
+    if (!mapped->open(filename)) {
+        return false;
+    }
+
+    ModelFileHeader header;
+    if (mapped->size() < sizeof(header)) {
+        std::cerr << "Not a kNN model file: " << filename << std::endl;
+        return false;
+    }
+    std::memcpy(&header, mapped->data(), sizeof(header));
+
+    if (std::memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        std::cerr << "Not a kNN model file: " << filename << std::endl;
+        return false;
+    }
+    if (header.version != MODEL_FILE_VERSION || header.endian_tag != MODEL_FILE_ENDIAN_TAG) {
+        std::cerr << "Unsupported model file version or byte order: " << filename << std::endl;
+        return false;
+    }
+    if (header.file_size != mapped->size()) {
+        std::cerr << "Model file is truncated: " << filename << std::endl;
+        return false;
+    }
+
+    const double* means = static_cast<const double*>(mapped->section(header.feature_means, alignof(double)));
+    const double* scales = static_cast<const double*>(mapped->section(header.feature_scales, alignof(double)));
+    if (!means || !scales ||
+        header.feature_means.bytes != header.dimensions * sizeof(double) ||
+        header.feature_scales.bytes != header.dimensions * sizeof(double)) {
+        std::cerr << "Model file standardization parameters are corrupt: " << filename << std::endl;
+        return false;
+    }
+
+    if (header.feature_storage > STORAGE_INT8) {
+        std::cerr << "Model file feature storage is corrupt: " << filename << std::endl;
+        return false;
+    }
+
+    // The file's leaf scan storage unless one was set on this model, attach maps the codes if they match
+    KD_Tree loaded(header.split_threshold);
+    if (feature_storage_set) {
+        loaded.setFeatureStorage(tree.getFeatureStorage(), tree.getRerankFactor());
+    } else {
+        loaded.setFeatureStorage(static_cast<FeatureStorage>(header.feature_storage), header.rerank_factor);
+    }
+    if (!loaded.attach(mapped, header)) {
+        return false;
+    }
+
+    tree = std::move(loaded);
+    k = static_cast<int>(header.k);
+    split_threshold = header.split_threshold;
+    scaler.assign(means, scales, header.dimensions);
+    chooseBackend();
+    return true;
+}
\ No newline at end of file
@@ -2,22 +2,161 @@
 #ifndef KNN_H
 #define KNN_H
 
+#include "BallTree.h"
+#include "BruteForce.h"
+#include "KDForest.h"
 #include "KD_Tree.h"
+#include "Scaler.h"
+#include "ThreadPool.h"
 #include "kNN_Data.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
+// How the k nearest neighbors decide the predicted label
+enum VoteRule {
+    VOTE_MAJORITY,         // one vote per neighbor
+    VOTE_DISTANCE_WEIGHTED // each neighbor votes with 1 / distance, exact matches outvote everything else
+};
+
+// Search engine behind KNN's predictions
+enum KNNBackend {
+    BACKEND_AUTO,        // KD-tree or brute force, picked after train()/load() by a cost model on rows, dimensions,
+                         // k and leaf size, so the same model and data always get the same backend
+    BACKEND_KD_TREE,
+    BACKEND_BRUTE_FORCE, // blocked linear scan, exact, ignores approximate search options
+    BACKEND_BALL_TREE,   // metric tree, the only backend for non-Euclidean metrics
+    BACKEND_KD_FOREST,   // the points sharded over several KD-trees that single queries search concurrently (see KDForest)
+    BACKEND_CALIBRATED   // opt-in: times the KD-tree, brute force and (from 10 dimensions) the ball tree on a few
+                         // sample queries and keeps the fastest; can pick differently from run to run
+};
+
+// Result of KNN::classify
+struct Prediction {
+    uint32_t label_id; // id into KNN::getLabels(), LabelTable::NOT_FOUND when the tree is empty
+    double confidence; // share of the total vote that went to label_id, in [0, 1]
+};
+
 class KNN {
 private:
+    std::unique_ptr<ThreadPool> pool; // created on first use by train or predictBatch
+    size_t thread_count;              // workers for train/predictBatch, 0 means one per hardware thread
+    size_t batch_chunk_size;          // queries handed out per work item in predictBatch
+    KDTreeSearchOptions search_options; // exact by default, see setSearchOptions
+    VoteRule vote_rule;
+    std::string positive_label; // label predict() reports as 1
+    KNNBackend backend;         // requested backend, see setBackend
+    KNNBackend active_backend;  // backend queries use, never BACKEND_AUTO or BACKEND_CALIBRATED
+    bool feature_storage_set;   // setFeatureStorage was called, load() keeps that storage instead of the file's
+    // Indexes derived from the tree, brought up to date by the first query after a change
+    mutable std::mutex backend_mutex; // serializes those lazy rebuilds between concurrent queries
+    mutable BruteForceSearch brute;
+    mutable std::atomic<bool> brute_stale; // brute's row ranges predate the last change to the tree
+    mutable BallTree ball;                 // copy of the tree's points
+    mutable std::atomic<bool> ball_stale;
+    mutable KDForest forest;               // sharded copy of the tree's points
+    mutable std::atomic<bool> forest_stale;
+
+    ThreadPool& threadPool();
 
+    // Query features in the scaled space of the tree, buffer is scratch space for the result
+    const double* scaleQuery(const Point& queryPoint, std::vector<double>& buffer) const;
+
+    // Resolves backend to active_backend once the tree is built
+    void chooseBackend();
+    void calibrateBackend(); // BACKEND_CALIBRATED's timing runs
+    // Label id of a row reported by the active backend
+    uint32_t labelOf(uint32_t row) const;
+    // Re-indexes brute or ball after the tree changed, before any searches run
+    void refreshBackend() const;
+    // Runs count searches on the active backend, concurrent lets the forest spread each one over its shards
+    void findNeighbors(KDTreeQuery* searches, size_t count, bool concurrent = false) const;
+
+    // Label decision from count (key, row) neighbors as left in KDTreeQuery::heap, votes is per-label scratch space
+    Prediction vote(const std::pair<double, uint32_t>* neighbors, size_t count, std::vector<double>& votes) const;
 
 public:
     KD_Tree tree;
     int k; // Number of neighbors for kNN
     double split_threshold; // Threshold for the kd_tree
+    Scaler scaler; // standardization fitted by the last train(), applied to every query
 
     KNN(int k, double threshold);
-    void train(Dataset& data); // Need to initialize the tree here 
-    int predict(const Point& queryPoint);
+    // Fits the scaler and builds the tree on a scaled copy, data itself is left as is
+    void train(const Dataset& data);
+    void train(const ColumnarDataset& data); // same, for the fast parser's columnar output
+
+    // Single queries are const and safe to run from many threads at once, as long as nothing
+    // modifies the model meanwhile (see KNNHandle for swapping models under live queries)
+
+    // Winning label of the k nearest neighbors and its share of the vote
+    Prediction classify(const Point& queryPoint) const;
+    std::vector<Prediction> classifyBatch(const Point* queries, size_t count);
+    // Exact classifyBatch for large batches through a dual-tree join (see KNNJoin): builds a tree
+    // over the queries and searches it against the training tree in one traversal
+    std::vector<Prediction> classifyBulk(const std::vector<Point>& queries);
+    const LabelTable& getLabels() const;
+
+    // Evaluation support: one search for the largest of ks, then out[i] is what classify() would
+    // return with k = ks[i], voted over the nearest ks[i] of those neighbors
+    void classifyEachK(const Point& queryPoint, const std::vector<size_t>& ks, Prediction* out) const;
+    // Same over count given neighbors, (key, row) pairs of the active backend, nearest first
+    void classifyEachK(const std::pair<double, uint32_t>* neighbors, size_t count, const std::vector<size_t>& ks,
+                       Prediction* out) const;
+
+    // Two-class shorthand for classify(): 1 if the winning label is the positive label, 0 otherwise
+    int predict(const Point& queryPoint) const;
+    int predict(const Point& queryPoint, size_t& nodesVisited) const; // also reports the tree nodes examined
+
+    // Builds the indexes queries would otherwise build lazily, so no later query waits on them
+    void prepare() const;
+
+    // Adds or removes one labelled point without retraining, scaled with the scaler fitted
+    // by train() (the scaler itself is not refitted)
+    void insert(const Point& point);
+    bool remove(const Point& point);
+
+    // Predicts count queries in parallel on the thread pool, labels[i] belongs to queries[i]
+    std::vector<int> predictBatch(const Point* queries, size_t count);
+    std::vector<int> predictBatch(const std::vector<Point>& queries);
+
+    // Forces a backend (for benchmarking) or goes back to BACKEND_AUTO or BACKEND_CALIBRATED
+    void setBackend(KNNBackend requested);
+    KNNBackend getActiveBackend() const;
+
+    // BACKEND_AUTO's choice for a training set of that shape: brute force when its estimated
+    // distance work per query is below the KD-tree's, the KD-tree otherwise
+    static KNNBackend estimateBackend(size_t rows, size_t dims, size_t k, size_t leafSize);
+
+    // Distance for neighbor search, METRIC_MANHATTAN and METRIC_COSINE switch to the ball tree
+    void setDistanceMetric(DistanceMetric metric);
+    DistanceMetric getDistanceMetric() const;
+
+    // Shards of BACKEND_KD_FOREST, 0 means one per hardware thread
+    void setShardCount(size_t shards);
+
+    void setVoteRule(VoteRule rule);
+    void setPositiveLabel(const std::string& label); // "Habitable" by default
+
+    void setThreadCount(size_t threads); // takes effect on the next train/predictBatch
+    void setBatchChunkSize(size_t queriesPerChunk);
+
+    // Switches predict/predictBatch to approximate search, pass KDTreeSearchOptions() for exact results
+    void setSearchOptions(const KDTreeSearchOptions& options);
+    const KDTreeSearchOptions& getSearchOptions() const;
+
+    // Leaf scan storage for predictions, see KD_Tree::setFeatureStorage. Saved with the model;
+    // load() uses the file's storage unless this was called, then it keeps this one.
+    void setFeatureStorage(FeatureStorage storage, size_t rerankFactor = 4);
+
+    // Versioned binary model file (see ModelFile.h). load() maps the file read-only and
+    // answers queries from the mapped pages; the first insert/remove copies them into memory.
+    // save() writes filename + ".tmp" and renames it over filename, so saving over a loaded
+    // model is safe and a failed save leaves the previous file in place.
+    bool save(const std::string& filename) const;
+    bool load(const std::string& filename);
 };
 
 #endif // KNN_H
\ No newline at end of file
@@ -0,0 +1,399 @@
+#include "kNN_DAT_Parser.h"
+#include "ModelFile.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+namespace {
+
+    void trim(const char*& begin, const char*& end) {
+        while (begin < end && (*begin == ' ' || *begin == '\t')) {
+            ++begin;
+        }
+        while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+            --end;
+        }
+    }
+
+    const char* findLineEnd(const char* begin, const char* end) {
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        return newline ? newline : end;
+    }
+
+    // Per-chunk results of the fast parser, label ids stay chunk-local until the merge
+    struct ParsedChunk {
+        size_t data_lines = 0; // lines the counting pass took for data, the rows reserved for this chunk
+        size_t rows = 0;       // of those, rows that parsed
+        size_t bad_lines = 0;
+        LabelTable labels;
+        bool has_threshold = false;
+        double threshold = 0.0;
+    };
+
+    // Calls onData(lineBegin, lineEnd) for every line of [begin, end) that is neither a comment
+    // nor the value line of a "# Threshold" comment, which goes to chunk instead
+    template <typename OnData>
+    void forEachDataLine(const char* begin, const char* end, ParsedChunk& chunk, OnData onData) {
+        bool thresholdNext = false;
+        while (begin < end) {
+            const char* lineEnd = findLineEnd(begin, end);
+            const char* next = lineEnd < end ? lineEnd + 1 : end;
+
+            if (kNN_Dat_Parser::isCommentOrEmpty(begin, lineEnd)) {
+                thresholdNext = thresholdNext || kNN_Dat_Parser::isThresholdComment(begin, lineEnd);
+            } else if (thresholdNext) {
+                // Line right after "# Threshold" holds the threshold value
+                chunk.has_threshold = kNN_Dat_Parser::parseNumber(begin, lineEnd, chunk.threshold) || chunk.has_threshold;
+                thresholdNext = false;
+            } else {
+                onData(begin, lineEnd);
+            }
+
+            begin = next;
+        }
+    }
+}
+
+bool kNN_Dat_Parser::isCommentOrEmpty(const char* begin, const char* end) {
+    trim(begin, end);
+    return begin == end || *begin == '#';
+}
+
+bool kNN_Dat_Parser::isThresholdComment(const char* begin, const char* end) {
+    trim(begin, end);
+    static const char keyword[] = "Threshold";
+    return begin < end && *begin == '#' &&
+           std::search(begin, end, keyword, keyword + sizeof(keyword) - 1) != end;
+}
+
+bool kNN_Dat_Parser::parseNumber(const char* begin, const char* end, double& value) {
+    trim(begin, end);
+    if (begin < end && *begin == '+') {
+        ++begin; // from_chars does not accept a leading plus
+    }
+    if (begin == end) {
+        return false;
+    }
+    std::from_chars_result result = std::from_chars(begin, end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+std::vector<std::string> kNN_Dat_Parser::splitFields(const char* begin, const char* end) {
+    std::vector<std::string> fields;
+    while (true) {
+        const char* comma = std::find(begin, end, ',');
+        const char* fieldBegin = begin;
+        const char* fieldEnd = comma;
+        trim(fieldBegin, fieldEnd);
+        fields.emplace_back(fieldBegin, fieldEnd);
+        if (comma == end) {
+            break;
+        }
+        begin = comma + 1;
+    }
+    return fields;
+}
+
+bool kNN_Dat_Parser::inspectRow(const char* begin, const char* end, size_t& dims, bool& labelled) {
+    std::vector<std::string> fields = splitFields(begin, end);
+    double value = 0.0;
+    const std::string& last = fields.back();
+    labelled = !parseNumber(last.data(), last.data() + last.size(), value);
+    dims = labelled ? fields.size() - 1 : fields.size();
+    return dims > 0;
+}
+
+bool kNN_Dat_Parser::parseRow(const char* begin, const char* end, size_t dims, bool labelled, double* values,
+                              std::string& label, size_t valueStride) {
+    for (size_t d = 0; d < dims; ++d) {
+        const char* comma = std::find(begin, end, ',');
+        if (!parseNumber(begin, comma, values[d * valueStride])) {
+            return false;
+        }
+        if (comma == end) {
+            return d + 1 == dims && !labelled;
+        }
+        begin = comma + 1;
+    }
+
+    if (!labelled) {
+        return false; // more fields than features
+    }
+    trim(begin, end);
+    if (std::find(begin, end, ',') != end) {
+        return false;
+    }
+    label.assign(begin, end);
+    return true;
+}
+
+ColumnarDataset kNN_Dat_Parser::parseColumnar(const std::string& filename, size_t threads) {
+    ColumnarDataset dataset;
+
+    MappedFile mapped;
+    if (!mapped.open(filename)) {
+        return dataset; // Return an empty dataset
+    }
+    const char* cursor = mapped.data();
+    const char* fileEnd = cursor + mapped.size();
+
+    // Preamble: comments (and a threshold) up to the header or the first data line
+    size_t dims = 0;
+    bool labelled = false;
+    bool thresholdNext = false;
+    while (cursor < fileEnd) {
+        const char* lineEnd = findLineEnd(cursor, fileEnd);
+        const char* next = lineEnd < fileEnd ? lineEnd + 1 : fileEnd;
+
+        if (isCommentOrEmpty(cursor, lineEnd)) {
+            thresholdNext = thresholdNext || isThresholdComment(cursor, lineEnd);
+            cursor = next;
+            continue;
+        }
+        if (thresholdNext) {
+            parseNumber(cursor, lineEnd, dataset.threshold);
+            thresholdNext = false;
+            cursor = next;
+            continue;
+        }
+
+        std::vector<std::string> fields = splitFields(cursor, lineEnd);
+        double value = 0.0;
+        if (dataset.header.empty() && !parseNumber(fields[0].data(), fields[0].data() + fields[0].size(), value)) {
+            dataset.header = fields;
+            cursor = next;
+            continue;
+        }
+
+        // First data line, left in place for the workers
+        inspectRow(cursor, lineEnd, dims, labelled);
+        break;
+    }
+    if (dims == 0) {
+        return dataset;
+    }
+
+    ThreadPool pool(threads);
+
+    // Line-aligned chunk boundaries, a few per worker so stealing can even out the load
+    size_t chunkCount = pool.size() * 4;
+    size_t dataBytes = static_cast<size_t>(fileEnd - cursor);
+    std::vector<const char*> bounds(chunkCount + 1, fileEnd);
+    bounds[0] = cursor;
+    for (size_t i = 1; i < chunkCount; ++i) {
+        const char* bound = std::max(bounds[i - 1], cursor + dataBytes * i / chunkCount);
+        if (bound > cursor && bound < fileEnd && bound[-1] != '\n') {
+            const char* lineEnd = findLineEnd(bound, fileEnd);
+            bound = lineEnd < fileEnd ? lineEnd + 1 : fileEnd;
+        }
+
+        // Keep a "# Threshold" comment in the same chunk as the value line after it
+        if (bound > cursor && bound < fileEnd) {
+            const char* lineStart = bound - 1;
+            while (lineStart > cursor && lineStart[-1] != '\n') {
+                --lineStart;
+            }
+            if (isThresholdComment(lineStart, bound - 1)) {
+                const char* lineEnd = findLineEnd(bound, fileEnd);
+                bound = lineEnd < fileEnd ? lineEnd + 1 : fileEnd;
+            }
+        }
+        bounds[i] = bound;
+    }
+
+    // Counting pass: data lines per chunk, so the matrix is sized once and every chunk gets its own row range
+    std::vector<ParsedChunk> chunks(chunkCount);
+    pool.parallelFor(chunkCount, 1, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            ParsedChunk& chunk = chunks[i];
+            forEachDataLine(bounds[i], bounds[i + 1], chunk, [&chunk](const char*, const char*) { ++chunk.data_lines; });
+        }
+    });
+
+    std::vector<size_t> rowOffsets(chunkCount + 1, 0);
+    for (size_t i = 0; i < chunkCount; ++i) {
+        rowOffsets[i + 1] = rowOffsets[i] + chunks[i].data_lines;
+    }
+    size_t rowCount = rowOffsets[chunkCount];
+    dataset.features.assign(dims, rowCount);
+    if (labelled) {
+        dataset.label_ids.resize(rowCount);
+    }
+
+    // Parsing pass: from_chars writes each value straight into its column, malformed lines are
+    // skipped, so a chunk's rows end up packed at the start of its range
+    pool.parallelFor(chunkCount, 1, [&](size_t begin, size_t end, size_t) {
+        std::string label;
+        for (size_t i = begin; i < end; ++i) {
+            ParsedChunk& chunk = chunks[i];
+            forEachDataLine(bounds[i], bounds[i + 1], chunk, [&](const char* lineBegin, const char* lineEnd) {
+                size_t row = rowOffsets[i] + chunk.rows;
+                if (!parseRow(lineBegin, lineEnd, dims, labelled, dataset.features.mutableColumn(0) + row, label,
+                              dataset.features.columnStride())) {
+                    ++chunk.bad_lines;
+                    return;
+                }
+                if (labelled) {
+                    dataset.label_ids[row] = chunk.labels.intern(label);
+                }
+                ++chunk.rows;
+            });
+        }
+    });
+
+    // Merge: global label ids in file order, then the chunk-local ids are rewritten in place
+    std::vector<std::vector<uint32_t>> labelRemap(chunkCount);
+    size_t badLines = 0;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        for (const std::string& name : chunks[i].labels.getNames()) {
+            labelRemap[i].push_back(dataset.labels.intern(name));
+        }
+        badLines += chunks[i].bad_lines;
+        if (chunks[i].has_threshold) {
+            dataset.threshold = chunks[i].threshold;
+        }
+    }
+    if (labelled) {
+        pool.parallelFor(chunkCount, 1, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i) {
+                for (size_t row = rowOffsets[i]; row < rowOffsets[i] + chunks[i].rows; ++row) {
+                    dataset.label_ids[row] = labelRemap[i][dataset.label_ids[row]];
+                }
+            }
+        });
+    }
+
+    // Malformed lines leave a gap at the end of their chunk's range, close them by moving later rows down
+    if (badLines > 0) {
+        size_t packed = 0;
+        for (size_t i = 0; i < chunkCount; ++i) {
+            size_t from = rowOffsets[i];
+            if (packed != from) {
+                for (size_t d = 0; d < dims; ++d) {
+                    double* column = dataset.features.mutableColumn(d);
+                    std::copy(column + from, column + from + chunks[i].rows, column + packed);
+                }
+                if (labelled) {
+                    std::copy(dataset.label_ids.begin() + from, dataset.label_ids.begin() + from + chunks[i].rows,
+                              dataset.label_ids.begin() + packed);
+                }
+            }
+            packed += chunks[i].rows;
+        }
+        dataset.features.truncate(packed);
+        if (labelled) {
+            dataset.label_ids.resize(packed);
+        }
+    }
+
+    if (badLines > 0) {
+        std::cerr << "Skipped " << badLines << " malformed lines in " << filename << std::endl;
+    }
+    return dataset;
+}
+
+kNN_Dat_ChunkReader::kNN_Dat_ChunkReader(size_t rowsPerChunk)
+        : rows_per_chunk(std::max<size_t>(1, rowsPerChunk)), dims(0), labelled(false),
+          has_pending_line(false), threshold(0.0) {
+}
+
+bool kNN_Dat_ChunkReader::open(const std::string& filename) {
+    file.close();
+    file.clear();
+    file.open(filename);
+    dims = 0;
+    has_pending_line = false;
+    header.clear();
+    labels.clear();
+    threshold = 0.0;
+
+    if (!file.is_open()) {
+        std::cerr << "Unable to open file: " << filename << std::endl;
+        return false;
+    }
+
+    // Header (if any) and the layout of the first data line
+    std::string line;
+    while (readLine(line)) {
+        std::vector<std::string> fields = kNN_Dat_Parser::splitFields(line.data(), line.data() + line.size());
+        double value = 0.0;
+        if (header.empty() && !kNN_Dat_Parser::parseNumber(fields[0].data(), fields[0].data() + fields[0].size(), value)) {
+            header = fields;
+            continue;
+        }
+        kNN_Dat_Parser::inspectRow(line.data(), line.data() + line.size(), dims, labelled);
+        pending_line = line;
+        has_pending_line = true;
+        break;
+    }
+    return true;
+}
+
+bool kNN_Dat_ChunkReader::readLine(std::string& line) {
+    bool thresholdNext = false;
+    while (std::getline(file, line)) {
+        const char* begin = line.data();
+        const char* end = begin + line.size();
+        if (kNN_Dat_Parser::isCommentOrEmpty(begin, end)) {
+            thresholdNext = thresholdNext || kNN_Dat_Parser::isThresholdComment(begin, end);
+            continue;
+        }
+        if (thresholdNext) {
+            kNN_Dat_Parser::parseNumber(begin, end, threshold);
+            thresholdNext = false;
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool kNN_Dat_ChunkReader::next(ColumnarDataset& chunk) {
+    if (dims == 0) {
+        return false;
+    }
+
+    std::vector<double> values;
+    std::vector<uint32_t> labelIds;
+    std::vector<double> row(dims);
+    std::string label;
+    std::string line;
+    size_t rows = 0;
+
+    while (rows < rows_per_chunk) {
+        if (has_pending_line) {
+            line.swap(pending_line);
+            has_pending_line = false;
+        } else if (!readLine(line)) {
+            break;
+        }
+
+        if (!kNN_Dat_Parser::parseRow(line.data(), line.data() + line.size(), dims, labelled, row.data(), label)) {
+            std::cerr << "Invalid line format: " << line << std::endl;
+            continue;
+        }
+        values.insert(values.end(), row.begin(), row.end());
+        if (labelled) {
+            labelIds.push_back(labels.intern(label));
+        }
+        ++rows;
+    }
+
+    if (rows == 0) {
+        return false;
+    }
+
+    chunk.features.assign(dims, rows);
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t d = 0; d < dims; ++d) {
+            chunk.features.set(r, d, values[r * dims + d]);
+        }
+    }
+    chunk.label_ids.swap(labelIds);
+    chunk.labels = labels;
+    chunk.header = header;
+    chunk.threshold = threshold;
+    return true;
+}
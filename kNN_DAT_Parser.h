@@ -6,6 +6,7 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 class kNN_Dat_Parser {
 public:
@@ -64,10 +65,58 @@ public:
         return dataset;
     }
 
+    // High-throughput mode for large files: maps the file, splits the data into line-aligned
+    // chunks, counts their data lines, then parses them in parallel with std::from_chars straight
+    // into each chunk's rows of one columnar feature matrix, with interned label ids. No copy of
+    // the parsed values is kept besides the result. threads == 0 uses every hardware thread.
+    // A first line whose leading field is not a number is taken as the header.
+    ColumnarDataset parseColumnar(const std::string& filename, size_t threads = 0);
+
+    // Shared line helpers for the fast parser and kNN_Dat_ChunkReader
+    static bool isCommentOrEmpty(const char* begin, const char* end);
+    static bool isThresholdComment(const char* begin, const char* end);
+    static bool parseNumber(const char* begin, const char* end, double& value);
+    // Splits a data line into dims features (and a trailing label when labelled), false if malformed.
+    // Feature d goes to values[d * valueStride], so a row can be parsed straight into the columns of a FeatureMatrix.
+    static bool parseRow(const char* begin, const char* end, size_t dims, bool labelled, double* values,
+                         std::string& label, size_t valueStride = 1);
+    // Works out the column layout from the first data line
+    static bool inspectRow(const char* begin, const char* end, size_t& dims, bool& labelled);
+    static std::vector<std::string> splitFields(const char* begin, const char* end);
+
 private:
     // Add private member variables or methods if needed
 
     // Method to handle specific parsing requirements for kNN, like feature extraction, label handling, etc.
 };
 
+// Streams a .dat file in chunks of at most rowsPerChunk rows, for files that do not fit in memory.
+// Label ids stay consistent across chunks: every chunk carries the label table seen so far.
+class kNN_Dat_ChunkReader {
+public:
+    explicit kNN_Dat_ChunkReader(size_t rowsPerChunk = 1 << 16);
+
+    bool open(const std::string& filename);
+
+    // Fills chunk with the next rows, returns false once the file is exhausted
+    bool next(ColumnarDataset& chunk);
+
+    const std::vector<std::string>& getHeader() const { return header; }
+    double getThreshold() const { return threshold; } // final once next() has returned false
+    size_t dimensions() const { return dims; }
+
+private:
+    bool readLine(std::string& line);
+
+    std::ifstream file;
+    size_t rows_per_chunk;
+    size_t dims;
+    bool labelled;
+    bool has_pending_line; // first data line, read while working out the layout
+    std::string pending_line;
+    std::vector<std::string> header;
+    LabelTable labels;
+    double threshold;
+};
+
 #endif // KNN_DAT_PARSER_H
@@ -1,6 +1,10 @@
 #ifndef kNN_Data_H
 #define kNN_Data_H
 
+#include "FeatureMatrix.h"
+#include "LabelTable.h"
+
+#include <cstdint>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -15,11 +19,17 @@ struct Point {
     Point(const std::vector<double>& f, const std::string& l = "") : features(f), label(l) {}
 
     double calculateDistance(const Point& other) const {
+        return std::sqrt(calculateSquaredDistance(other));
+    }
+
+    // Squared Euclidean distance, enough for comparing and pruning without the sqrt
+    double calculateSquaredDistance(const Point& other) const {
         double sum = 0.0;
         for (size_t i = 0; i < features.size(); ++i) {
-            sum += (features[i] - other.features[i]) * (features[i] - other.features[i]);
+            double diff = features[i] - other.features[i];
+            sum += diff * diff;
         }
-        return std::sqrt(sum);
+        return sum;
     }
 };
 
@@ -37,4 +47,27 @@ struct Dataset {
 
 };
 
+// Columnar dataset: features in one SoA matrix and labels as ids into a name table,
+// as produced by the fast .dat parser
+struct ColumnarDataset {
+    FeatureMatrix features;               // row i holds the features of point i
+    std::vector<uint32_t> label_ids;      // label id of every row, empty if the data is unlabelled
+    LabelTable labels;                    // label id <-> label
+    std::vector<std::string> header;      // Header for the dataset
+    double threshold;                     // Threshold for the dataset
+
+    ColumnarDataset() : threshold(0.0) {}
+
+    size_t size() const { return features.size(); }
+
+    const std::string& label(size_t row) const {
+        static const std::string unlabelled;
+        return label_ids.empty() ? unlabelled : labels.name(label_ids[row]);
+    }
+
+    Point point(size_t row) const {
+        return Point(features.row(row), label(row));
+    }
+};
+
 #endif // kNN_Data_H
\ No newline at end of file